@@ -1,5 +1,6 @@
 #include "alsh.h"
 #include "common.h"
+#include "topk.h"
 
 #include <cstdio>
 #include <cstdint>
@@ -18,12 +19,6 @@
 
 using namespace std;
 
-bool sort_pred(
-        const std::pair<faiss::Index::idx_t, int> left,
-           const std::pair<faiss::Index::idx_t, int> right) {
-    return left.second > right.second;
-}
-
 int IndexALSH::dot_product_hash(
         const float* a, const float* x, const float b) const {
     float ax = faiss::fvec_inner_product(a, x, d);
@@ -55,11 +50,11 @@ static lsh_metahash_t::hash_t combine_hashes(vector<int> values) {
     return seed;
 }
 
-void IndexALSH::hash_vectors(FloatMatrix &data) {
+void IndexALSH::hash_vectors(const FloatMatrix& data, idx_t first_id) {
 #pragma omp parallel for
     for (size_t l = 0; l < L; l++) {
         for (size_t i = 0; i < data.vector_count(); i++) {
-            metahashes[l].table[calculate_metahash(l, data.row(i))].insert(i);
+            metahashes[l].table[calculate_metahash(l, data.row(i))].insert(first_id + i);
         }
     }
 }
@@ -86,19 +81,14 @@ vector<faiss::Index::idx_t> IndexALSH::answer_query(float *query, size_t k_neede
             }
         }
     }
-    vector<pair<idx_t, int> > score_vector(score.begin(), score.end());
-    if (score_vector.size() > k_needed) {
-        nth_element(
-            score_vector.begin(), 
-            score_vector.begin() + k_needed, 
-            score_vector.end(),
-            sort_pred);
-        score_vector.resize(k_needed);
+    TopK<idx_t> best(k_needed);
+    for (const auto& vec_score: score) {
+        best.push(vec_score.second, vec_score.first);
     }
-    sort(score_vector.begin(), score_vector.end(), sort_pred);
+    best.sort();
     vector<idx_t> res;
-    for (size_t i = 0; i < score_vector.size(); i++) {
-        res.push_back(score_vector[i].first);
+    for (const auto& entry: best.entries) {
+        res.push_back(entry.second);
     }
     return res;
 }
@@ -125,11 +115,17 @@ void IndexALSH::reset() {
     for (size_t l = 0; l < L; l++) {
         metahashes[l].table.clear();
     }
+    ntotal = 0;
+}
+
+void IndexALSH::train(idx_t n, const float* data) {
+    augmentation->train(data, n);
 }
 
 void IndexALSH::add(idx_t n, const float* data) {
     FloatMatrix data_matrix = augmentation->extend(data, n);
-    hash_vectors(data_matrix);
+    hash_vectors(data_matrix, ntotal);
+    ntotal += n;
 }
 
 void IndexALSH::search(
@@ -22,7 +22,8 @@ struct IndexALSH: public faiss::Index {
     void add(idx_t n, const float* data);
     void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels) const;
     void reset();
-    // void train(idx_t n, const float* data);
+    // Fixes the scaling of the augmentation, otherwise the first add() does.
+    void train(idx_t n, const float* data);
 
     std::vector<lsh_metahash_t> metahashes;
 
@@ -34,7 +35,7 @@ struct IndexALSH: public faiss::Index {
 
     MipsAugmentation* augmentation;
 
-    void hash_vectors(FloatMatrix& data);
+    void hash_vectors(const FloatMatrix& data, idx_t first_id);
     int dot_product_hash(const float* a, const float* x, const float b) const;
     std::vector<idx_t> answer_query(float *query, size_t k_needed = 1) const;
     lsh_metahash_t::hash_t calculate_metahash(size_t l, const float* data) const;
@@ -2,11 +2,21 @@
 
 #include <cstdio>
 #include <cassert>
-
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <omp.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "../faiss/AutoTune.h"
 #include "../src/common.h"
+#include "../src/reader.h"
 
 
 double elapsed () {
@@ -75,90 +85,390 @@ void bench_add(faiss::Index* index) {
     printf("Add time = %.6f\n", add_time);
 }
 
-void bench_query(faiss::Index* index) {
+void bench_add_chunked(faiss::Index* index, size_t batch_size) {
     double t0 = elapsed();
 
-    size_t d = index->d;
+    printf ("[%.3f s] Streaming database in batches of %zu\n", elapsed() - t0, batch_size);
 
-    FloatMatrix xq;
-    size_t nq;
+    ChunkedReader reader(filenames[1], batch_size);
+    assert(index->d == int(reader.dim) || !"dataset does not have same dimension as train set");
 
-    {
-        printf ("[%.3f s] Loading queries\n", elapsed() - t0);
+    // Reading of the next batch overlaps with adding the current one.
+    FloatMatrix batch;
+    double begin_add = elapsed();
+    while (reader.next(batch)) {
+        index->add(batch.vector_count(), batch.data.data());
+    }
+    double add_time = elapsed() - begin_add;
+    printf ("[%.3f s] Indexed %zu vectors\n", elapsed() - t0, reader.count);
+    printf("Add time = %.6f\n", add_time);
+}
 
-        xq = load_vecs<float>(filenames[2]);
-        size_t d2 = xq.vector_length;
-        nq = xq.vector_count();
-        assert(d == d2 || !"query does not have same dimension as train set");
+FloatMatrix bench_load_queries() {
+    return load_vecs<float>(filenames[2]);
+}
 
+FlatMatrix<faiss::Index::idx_t> bench_load_ground_truth() {
+    // load ground-truth and convert int to long
+    FlatMatrix<int> gt_int = load_vecs<int>(filenames[3]);
+    FlatMatrix<faiss::Index::idx_t> gt;
+    gt.resize(gt_int.vector_count(), gt_int.vector_length);
+    for (size_t i = 0; i < gt_int.data.size(); i++) {
+        gt.data[i] = gt_int.data[i];
     }
+    return gt;
+}
 
-    size_t k; // nb of results per query in the GT
-    FlatMatrix<faiss::Index::idx_t> gt;  // nq * k matrix of ground-truth nearest-neighbors
+RecallReport bench_recall(const FlatMatrix<faiss::Index::idx_t>& gt,
+        const faiss::Index::idx_t* I, size_t k) {
+    size_t nq = gt.vector_count();
+
+    // evaluate result by hand.
+    int n_1 = 0, n_10 = 0, n_100 = 0;
+    for(size_t i = 0; i < nq; i++) {
+        faiss::Index::idx_t gt_nn = gt.at(i, 0);
+        for(size_t j = 0; j < k; j++) {
+            if (I[i * k + j] == gt_nn) {
+                if(j < 1) n_1++;
+                if(j < 10) n_10++;
+                if(j < 100) n_100++;
+            }
+        }
+    }
 
-    {
-        printf ("[%.3f s] Loading ground truth for %ld queries\n",
-                elapsed() - t0, nq);
+    // find intersection of ground truth top100 and our top100
+    size_t common_count = 0;
+    for (size_t i = 0; i < nq; i++) {
+        for (size_t l = 0; l < 100; l++) {
+            faiss::Index::idx_t current_val = gt.at(i, l);
+            for (size_t j = 0; j < 100; j++) {
+                if (I[i * k + j] == current_val) {
+                    common_count++;
+                    break;
+                }
+            }
+        }
+    }
 
-        // load ground-truth and convert int to long
-        FlatMatrix<int> gt_int = load_vecs<int>(filenames[3]);
-        k = gt_int.vector_length;
-        size_t ngt = gt_int.vector_count();
+    RecallReport report;
+    report.r1 = n_1 / double(nq);
+    report.r10 = n_10 / double(nq);
+    report.r100 = n_100 / double(nq);
+    report.intersection = common_count / double(100 * nq);
+    return report;
+}
 
-        assert(ngt == nq || !"incorrect nb of ground truth entries");
+void bench_query(faiss::Index* index) {
+    double t0 = elapsed();
 
-        gt.resize(ngt, k);
-        for(size_t i = 0; i < k * nq; i++) {
-            gt.data[i] = gt_int.data[i];
-        }
-    }
+    size_t d = index->d;
+
+    printf ("[%.3f s] Loading queries\n", elapsed() - t0);
+    FloatMatrix xq = bench_load_queries();
+    size_t nq = xq.vector_count();
+    assert(d == xq.vector_length || !"query does not have same dimension as train set");
 
+    printf ("[%.3f s] Loading ground truth for %ld queries\n",
+            elapsed() - t0, nq);
+    // nq * k matrix of ground-truth nearest-neighbors
+    FlatMatrix<faiss::Index::idx_t> gt = bench_load_ground_truth();
+    size_t k = gt.vector_length;
+    assert(gt.vector_count() == nq || !"incorrect nb of ground truth entries");
 
     {
         printf ("[%.3f s] Perform a search on %ld queries\n",
                 elapsed() - t0, nq);
 
         // output buffers
-        faiss::Index::idx_t *I = new faiss::Index::idx_t[nq * k];
-        float *D = new float[nq * k];
+        std::vector<faiss::Index::idx_t> I(nq * k);
+        std::vector<float> D(nq * k);
 
         double begin_search = elapsed();
-        index->search(nq, xq.data.data(), k, D, I);
+        index->search(nq, xq.data.data(), k, D.data(), I.data());
         double search_time = elapsed() - begin_search;
 
         printf ("[%.3f s] Compute recalls\n", elapsed() - t0);
+        RecallReport recall = bench_recall(gt, I.data(), k);
+
+        printf("Intersection = %.6f\n", recall.intersection);
+        printf("Search time = %.6f\n", search_time);
+        printf("R@1 = %.6f\n", recall.r1);
+        printf("R@10 = %.6f\n", recall.r10);
+        printf("R@100 = %.6f\n", recall.r100);
+    }
+
+    if (getenv("BENCH_CLIENTS")) {
+        LatencyParams params = latency_params_from_env();
+        params.k = k;
+        printf ("[%.3f s] Measure latencies\n", elapsed() - t0);
+        print_latency(params, bench_latency(index, xq, params));
+    }
+}
+
+// Buckets of 128 values for every power of two above the first 256 values.
+static const size_t latency_sub_bits = 8;
+
+static size_t latency_bucket(uint64_t ns) {
+    if (ns < (1u << latency_sub_bits)) {
+        return ns;
+    }
+    size_t shift = 63 - __builtin_clzll(ns) - latency_sub_bits + 1;
+    return (shift << (latency_sub_bits - 1)) + (ns >> shift);
+}
+
+// Largest value of the bucket.
+static uint64_t latency_bucket_end(size_t bucket) {
+    if (bucket < (1u << latency_sub_bits)) {
+        return bucket;
+    }
+    size_t shift = (bucket >> (latency_sub_bits - 1)) - 1;
+    uint64_t mantissa = bucket - (shift << (latency_sub_bits - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+LatencyHistogram::LatencyHistogram():
+    buckets(64 << (latency_sub_bits - 1), 0), count(0), max(0) {}
+
+void LatencyHistogram::record(double seconds, size_t n) {
+    buckets[latency_bucket(uint64_t(seconds * 1e9))] += n;
+    count += n;
+    max = std::max(max, seconds);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < buckets.size(); i++) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    max = std::max(max, other.max);
+}
+
+double LatencyHistogram::percentile(double p) const {
+    uint64_t target = std::max<uint64_t>(1, ceil(p * count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return std::min(max, latency_bucket_end(i) * 1e-9);
+        }
+    }
+    return max;
+}
 
-        // evaluate result by hand.
-        int n_1 = 0, n_10 = 0, n_100 = 0;
-        for(size_t i = 0; i < nq; i++) {
-            int gt_nn = gt.at(i, 0);
-            for(size_t j = 0; j < k; j++) {
-                if (I[i * k + j] == gt_nn) {
-                    if(j < 1) n_1++;
-                    if(j < 10) n_10++;
-                    if(j < 100) n_100++;
+LatencyParams::LatencyParams():
+    clients(1), batch_size(1), warmup(100), repeats(1), k(100), search_threads(0) {}
+
+static size_t env_size(const char* name, size_t value) {
+    const char* env = getenv(name);
+    return env ? strtoul(env, nullptr, 10) : value;
+}
+
+LatencyParams latency_params_from_env() {
+    LatencyParams params;
+    params.clients = std::max<size_t>(1, env_size("BENCH_CLIENTS", params.clients));
+    params.batch_size = std::max<size_t>(1, env_size("BENCH_BATCH", params.batch_size));
+    params.warmup = env_size("BENCH_WARMUP", params.warmup);
+    params.repeats = env_size("BENCH_REPEATS", params.repeats);
+    params.search_threads = env_size("BENCH_SEARCH_THREADS", params.search_threads);
+    return params;
+}
+
+// Makes calls search calls from params.clients threads, cycling over the
+// query batches. Latencies are recorded in histograms, one per client, if
+// given.
+static void run_clients(const faiss::Index* index, const FloatMatrix& queries,
+        const LatencyParams& params, size_t calls, std::vector<LatencyHistogram>* histograms) {
+    size_t nq = queries.vector_count();
+    size_t batch = std::max<size_t>(1, std::min(params.batch_size, nq));
+    size_t batches = (nq + batch - 1) / batch;
+    if (batches == 0) {
+        return;
+    }
+    std::atomic<size_t> next(0);
+
+    std::vector<std::thread> clients;
+    for (size_t t = 0; t < params.clients; t++) {
+        clients.emplace_back([&, t]() {
+            if (params.search_threads > 0) {
+                omp_set_num_threads(params.search_threads);
+            }
+            std::vector<float> D(batch * params.k);
+            std::vector<faiss::Index::idx_t> I(batch * params.k);
+            for (size_t call = next++; call < calls; call = next++) {
+                size_t begin = call % batches * batch;
+                size_t count = std::min(batch, nq - begin);
+                auto start = std::chrono::steady_clock::now();
+                index->search(count, queries.row(begin), params.k, D.data(), I.data());
+                std::chrono::duration<double> latency = std::chrono::steady_clock::now() - start;
+                if (histograms) {
+                    (*histograms)[t].record(latency.count(), count);
                 }
             }
+        });
+    }
+    for (auto& client: clients) {
+        client.join();
+    }
+}
+
+LatencyReport bench_latency(const faiss::Index* index, const FloatMatrix& queries,
+        const LatencyParams& params) {
+    size_t nq = queries.vector_count();
+    size_t batch = std::max<size_t>(1, std::min(params.batch_size, nq));
+    size_t batches = (nq + batch - 1) / batch;
+
+    run_clients(index, queries, params, params.warmup, nullptr);
+
+    std::vector<LatencyHistogram> histograms(params.clients);
+    double begin = elapsed();
+    run_clients(index, queries, params, params.repeats * batches, &histograms);
+
+    LatencyReport report;
+    report.seconds = elapsed() - begin;
+    for (const auto& histogram: histograms) {
+        report.histogram.merge(histogram);
+    }
+    report.queries = report.histogram.count;
+    report.qps = report.queries ? report.queries / report.seconds : 0;
+    return report;
+}
+
+void print_latency(const LatencyParams& params, const LatencyReport& report) {
+    printf("Latency of %zu queries, %zu clients, batches of %zu\n",
+            report.queries, params.clients, params.batch_size);
+    printf("QPS = %.3f\n", report.qps);
+    const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    const char* names[] = {"p50", "p90", "p99", "p99.9"};
+    for (size_t i = 0; i < 4; i++) {
+        printf("Latency %s [ms] = %.6f\n", names[i], report.histogram.percentile(percentiles[i]) * 1e3);
+    }
+    printf("Latency max [ms] = %.6f\n", report.histogram.max * 1e3);
+}
+
+double resident_memory_mb() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    size_t pages = 0, resident = 0;
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * double(sysconf(_SC_PAGESIZE)) / (1 << 20);
+}
+
+void mark_pareto(std::vector<SweepRow>& rows) {
+    // Scanning by decreasing QPS, a row is on the frontier iff its recall
+    // beats every faster row.
+    std::vector<size_t> order(rows.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&rows](size_t a, size_t b) {
+        if (rows[a].latency.qps != rows[b].latency.qps) {
+            return rows[a].latency.qps > rows[b].latency.qps;
         }
+        return rows[a].recall.r10 > rows[b].recall.r10;
+    });
+    double best_recall = -1;
+    for (size_t i: order) {
+        rows[i].pareto = rows[i].recall.r10 > best_recall;
+        best_recall = std::max(best_recall, rows[i].recall.r10);
+    }
+}
+
+static bool is_number(const std::string& value) {
+    char* end;
+    strtod(value.c_str(), &end);
+    return !value.empty() && *end == '\0';
+}
+
+static const char* metric_names[] = {
+    "r1", "r10", "r100", "intersection", "search_time", "qps",
+    "p50_ms", "p90_ms", "p99_ms", "p999_ms", "rss_growth_mb",
+};
 
-        // find intersection of ground truth top100 and our top100
-        size_t common_count = 0;
-        for (size_t i = 0; i < nq; i++) {
-            for (size_t l = 0; l < 100; l++) {
-                int current_val = gt.at(i, l);
-                for (size_t j = 0; j < 100; j++) {
-                    if (I[i * k + j] == current_val) {
-                        common_count++;
-                        break;
-                    }
+static std::vector<double> metric_values(const SweepRow& row) {
+    const LatencyHistogram& h = row.latency.histogram;
+    return {
+        row.recall.r1, row.recall.r10, row.recall.r100, row.recall.intersection,
+        row.search_time, row.latency.qps,
+        h.percentile(0.5) * 1e3, h.percentile(0.9) * 1e3,
+        h.percentile(0.99) * 1e3, h.percentile(0.999) * 1e3,
+        row.rss_growth_mb,
+    };
+}
+
+static void write_sweep_csv(FILE* f, const std::vector<SweepRow>& rows) {
+    // Columns of all parameters in order of first appearance, rows without
+    // some parameter leave it empty.
+    std::vector<std::string> names;
+    for (const auto& row: rows) {
+        for (const auto& param: row.params) {
+            if (std::find(names.begin(), names.end(), param.first) == names.end()) {
+                names.push_back(param.first);
+            }
+        }
+    }
+    for (const auto& name: names) {
+        fprintf(f, "%s,", name.c_str());
+    }
+    for (const char* metric: metric_names) {
+        fprintf(f, "%s,", metric);
+    }
+    fprintf(f, "pareto\n");
+    for (const auto& row: rows) {
+        for (const auto& name: names) {
+            for (const auto& param: row.params) {
+                if (param.first == name) {
+                    fprintf(f, "%s", param.second.c_str());
+                    break;
                 }
             }
+            fprintf(f, ",");
+        }
+        for (double value: metric_values(row)) {
+            fprintf(f, "%.6f,", value);
         }
+        fprintf(f, "%d\n", int(row.pareto));
+    }
+}
 
-        printf("Intersection = %.6f\n", common_count / float(100 * nq));
-        printf("Search time = %.6f\n", search_time);
-        printf("R@1 = %.6f\n", n_1 / float(nq));
-        printf("R@10 = %.6f\n", n_10 / float(nq));
-        printf("R@100 = %.6f\n", n_100 / float(nq));
+static void write_sweep_json(FILE* f, const std::vector<SweepRow>& rows) {
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < rows.size(); i++) {
+        const SweepRow& row = rows[i];
+        fprintf(f, "  {\"params\": {");
+        for (size_t j = 0; j < row.params.size(); j++) {
+            const auto& param = row.params[j];
+            const char* quote = is_number(param.second) ? "" : "\"";
+            fprintf(f, "%s\"%s\": %s%s%s", j ? ", " : "", param.first.c_str(),
+                    quote, param.second.c_str(), quote);
+        }
+        fprintf(f, "}");
+        std::vector<double> values = metric_values(row);
+        for (size_t j = 0; j < values.size(); j++) {
+            fprintf(f, ", \"%s\": %.6f", metric_names[j], values[j]);
+        }
+        fprintf(f, ", \"pareto\": %s}%s\n", row.pareto ? "true" : "false",
+                i + 1 < rows.size() ? "," : "");
+    }
+    fprintf(f, "]\n");
+}
+
+void write_sweep(const std::string& filename, const std::vector<SweepRow>& rows) {
+    FILE* f = fopen(filename.c_str(), "w");
+    if (!f) {
+        throw std::runtime_error("Failed to open file " + filename);
+    }
+    bool json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+    if (json) {
+        write_sweep_json(f, rows);
+    } else {
+        write_sweep_csv(f, rows);
+    }
+    if (fclose(f) != 0) {
+        throw std::runtime_error("Failed to write file " + filename);
     }
 }
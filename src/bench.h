@@ -5,9 +5,114 @@
 
 #include "../faiss/Index.h"
 
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Wall-clock time in seconds.
+double elapsed();
 
 faiss::Index* bench_train(faiss::Index* get_trained_index(const FloatMatrix& xt));
 void bench_add(faiss::Index* index);
+// Adds the database in batches read in the background, for indexes that
+// support repeated add calls.
+void bench_add_chunked(faiss::Index* index, size_t batch_size);
+// Learn, base, query and ground-truth files of the benchmark dataset.
+extern std::string filenames[4];
+
+FloatMatrix bench_load_queries();
+// Ids of the 100 best base vectors of every query.
+FlatMatrix<faiss::Index::idx_t> bench_load_ground_truth();
+
+struct RecallReport {
+    double r1, r10, r100;
+    // Share of the ground-truth top 100 found in the top 100 results.
+    double intersection;
+};
+
+// labels holds k >= 100 results of every query of gt.
+RecallReport bench_recall(const FlatMatrix<faiss::Index::idx_t>& gt,
+        const faiss::Index::idx_t* labels, size_t k);
+
+// Searches all queries in one call and prints recalls. If BENCH_CLIENTS is
+// set, latencies are then measured as well, see latency_params_from_env.
 void bench_query(faiss::Index* index);
 
+// Log-linear histogram of latencies in the style of HdrHistogram: values in
+// nanoseconds are bucketed by their 8 most significant bits, so percentiles
+// overestimate by less than 1/128 (0.8%) over any range and per-thread
+// histograms merge cheaply.
+struct LatencyHistogram {
+    LatencyHistogram();
+    void record(double seconds, size_t count = 1);
+    void merge(const LatencyHistogram& other);
+    // Smallest latency in seconds not exceeded by fraction p of the records.
+    double percentile(double p) const;
+
+    std::vector<uint64_t> buckets;
+    uint64_t count;
+    double max;
+};
+
+struct LatencyParams {
+    LatencyParams();
+
+    // Concurrent client threads, each waiting for its search to return
+    // before issuing the next one.
+    size_t clients;
+    // Queries per search call. The latency of a call counts for each of
+    // its queries.
+    size_t batch_size;
+    // Search calls made before timing starts.
+    size_t warmup;
+    // Passes over the query set.
+    size_t repeats;
+    // Results per query.
+    size_t k;
+    // OpenMP threads of every search call, 0 keeps the default.
+    size_t search_threads;
+};
+
+// Parameters from BENCH_CLIENTS, BENCH_BATCH, BENCH_WARMUP, BENCH_REPEATS
+// and BENCH_SEARCH_THREADS, defaults for those not set.
+LatencyParams latency_params_from_env();
+
+struct LatencyReport {
+    size_t queries;
+    double seconds;
+    double qps;
+    LatencyHistogram histogram;
+};
+
+LatencyReport bench_latency(const faiss::Index* index, const FloatMatrix& queries,
+        const LatencyParams& params);
+void print_latency(const LatencyParams& params, const LatencyReport& report);
+
+// Resident set size of the process in MB.
+double resident_memory_mb();
+
+// One search setting of a parameter sweep.
+struct SweepRow {
+    // Index and search parameters as name, value pairs.
+    std::vector<std::pair<std::string, std::string>> params;
+    RecallReport recall;
+    // Time of a single search call over all queries.
+    double search_time;
+    LatencyReport latency;
+    // Growth of the resident set across training and adding, an
+    // approximation of the memory taken by the index: it also counts
+    // allocator caches and freed pages not returned to the system.
+    double rss_growth_mb;
+    // No other row has R@10 and latency QPS both at least as high, one of
+    // them higher.
+    bool pareto;
+};
+
+// Sets pareto of every row.
+void mark_pareto(std::vector<SweepRow>& rows);
+// Writes rows as JSON if filename ends with .json, as CSV otherwise.
+void write_sweep(const std::string& filename, const std::vector<SweepRow>& rows);
+
 #endif
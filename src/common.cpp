@@ -1,150 +1,553 @@
 #include "common.h"
 
-#include "../faiss/Clustering.h"
 #include "../faiss/IndexFlat.h"
 #include "../faiss/utils.h"
 
 #include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
 
+#include <fcntl.h>
+#include <immintrin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-kmeans_result perform_kmeans(const FlatMatrix<float>& matrix, size_t k) {
-    kmeans_result kr;
-    kr.centroids.resize(k, matrix.vector_length);
-    kr.assignments.resize(matrix.vector_count());
-    std::vector<float> dist(matrix.vector_count());
-    std::vector<faiss::Index::idx_t> assignments(matrix.vector_count());
-
-    faiss::kmeans_clustering(
-        matrix.vector_length, 
-        matrix.vector_count(), 
-        k, 
-        matrix.data.data(), 
-        kr.centroids.data.data()
-    );
-
-    faiss::IndexFlatL2 index(matrix.vector_length);
-    index.add(kr.centroids.vector_count(), kr.centroids.data.data());
-    index.search(matrix.vector_count(), matrix.data.data(), 1,
-            dist.data(), assignments.data());
-
-    for (size_t i = 0; i < matrix.vector_count(); i++) {
-        kr.assignments[i] = assignments[i];
+
+KmeansParams::KmeansParams():
+    iterations(25), sample_size(0), max_points_per_centroid(256), batch_size(0),
+    init(KMEANS_RANDOM), seed(1234) {}
+
+// Writes the closest centroid of each of the n rows of x and its squared
+// distance.
+static void assign_to_centroids(const FloatMatrix& centroids, const float* x, size_t n,
+        std::vector<faiss::Index::idx_t>& labels, std::vector<float>& dist) {
+    faiss::IndexFlatL2 index(centroids.vector_length);
+    index.add(centroids.vector_count(), centroids.data.data());
+    labels.resize(n);
+    dist.resize(n);
+    index.search(n, x, 1, dist.data(), labels.data());
+}
+
+// k-means++ seeding takes k sequential passes over its rows, so it runs on
+// at most this many rows per centroid.
+static const size_t init_points_per_centroid = 16;
+
+// Writes the squared distances of the n rows of x to each of the count rows
+// of candidates, row-major.
+static void candidate_distances(const FloatMatrix& candidates, const float* x, size_t n,
+        std::vector<float>& dist) {
+    size_t count = candidates.vector_count();
+    faiss::IndexFlatL2 index(candidates.vector_length);
+    index.add(count, candidates.data.data());
+    std::vector<faiss::Index::idx_t> labels(n * count);
+    std::vector<float> sorted(n * count);
+    index.search(n, x, count, sorted.data(), labels.data());
+    dist.resize(n * count);
+    for (size_t i = 0; i < n * count; i++) {
+        dist[i / count * count + labels[i]] = sorted[i];
     }
-    return kr;
 }
 
-void scale(float* vec, float alpha, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        vec[i] /= alpha;
+static FloatMatrix init_centroids(const FloatMatrix& sample, size_t k,
+        const KmeansParams& params, std::mt19937& gen) {
+    size_t n = sample.vector_count(), d = sample.vector_length;
+    if (params.init == KMEANS_RANDOM) {
+        return sample_rows(sample.data.data(), n, d, k, gen());
+    }
+    FloatMatrix subsample;
+    if (n > init_points_per_centroid * k) {
+        n = init_points_per_centroid * k;
+        subsample = sample_rows(sample.data.data(), sample.vector_count(), d, n, gen());
     }
+    const FloatMatrix& rows = subsample.vector_count() ? subsample : sample;
+
+    FloatMatrix centroids, candidates;
+    centroids.resize(k, d);
+    candidates.resize(1, d);
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    memcpy(candidates.row(0), rows.row(pick(gen)), d * sizeof(float));
+    memcpy(centroids.row(0), candidates.row(0), d * sizeof(float));
+    // Squared distance of every row to its closest centroid so far.
+    std::vector<float> closest;
+    candidate_distances(candidates, rows.data.data(), n, closest);
+
+    size_t trials = params.init == KMEANS_GREEDY ? 2 + size_t(log(double(k))) : 1;
+    std::vector<double> cumulative(n);
+    std::vector<float> dist;
+    candidates.resize(trials, d);
+    for (size_t c = 1; c < k; c++) {
+        double total = 0;
+        for (size_t i = 0; i < n; i++) {
+            total += closest[i];
+            cumulative[i] = total;
+        }
+        std::uniform_real_distribution<double> draw(0, total);
+        for (size_t t = 0; t < trials; t++) {
+            size_t candidate = std::upper_bound(cumulative.begin(), cumulative.end(), draw(gen))
+                    - cumulative.begin();
+            candidate = std::min(candidate, n - 1);
+            memcpy(candidates.row(t), rows.row(candidate), d * sizeof(float));
+        }
+        candidate_distances(candidates, rows.data.data(), n, dist);
+        // The candidate that lowers the total squared distance most.
+        double best_cost = HUGE_VAL;
+        size_t best = 0;
+        for (size_t t = 0; t < trials; t++) {
+            double cost = 0;
+            for (size_t i = 0; i < n; i++) {
+                cost += std::min(closest[i], dist[i * trials + t]);
+            }
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = t;
+            }
+        }
+        memcpy(centroids.row(c), candidates.row(best), d * sizeof(float));
+        for (size_t i = 0; i < n; i++) {
+            closest[i] = std::min(closest[i], dist[i * trials + best]);
+        }
+    }
+    return centroids;
 }
 
-static FloatMatrix shrivastava_extend(const float* data, size_t nvecs, size_t dim, size_t m, float U) {
-    FloatMatrix data_matrix;
-    data_matrix.resize(nvecs, dim + m);
-    for (size_t i = 0; i < nvecs; i++) {
-        memcpy(data_matrix.row(i), data + i * dim, dim * sizeof(float));
+// Moves centroids to the means of their rows. An empty cluster takes half
+// of the largest one: both centroids are the old one slightly perturbed in
+// opposite directions.
+static void update_centroids(const FloatMatrix& sample,
+        const std::vector<faiss::Index::idx_t>& labels, FloatMatrix& centroids) {
+    size_t n = sample.vector_count(), d = sample.vector_length, k = centroids.vector_count();
+    std::vector<float> sums(k * d, 0);
+    std::vector<size_t> counts(k, 0);
+    #pragma omp parallel
+    {
+        std::vector<float> local_sums(k * d, 0);
+        std::vector<size_t> local_counts(k, 0);
+        #pragma omp for
+        for (size_t i = 0; i < n; i++) {
+            size_t c = labels[i];
+            local_counts[c]++;
+            faiss::fvec_madd(d, local_sums.data() + c * d, 1, sample.row(i), local_sums.data() + c * d);
+        }
+        #pragma omp critical
+        for (size_t c = 0; c < k; c++) {
+            counts[c] += local_counts[c];
+            for (size_t j = 0; j < d; j++) {
+                sums[c * d + j] += local_sums[c * d + j];
+            }
+        }
     }
 
-    double maxnorm = 0;
-    for (size_t i = 0; i < data_matrix.vector_count(); i++) {
-        maxnorm = std::max(maxnorm, sqrt(faiss::fvec_norm_L2sqr(data_matrix.row(i), dim)));
+    for (size_t c = 0; c < k; c++) {
+        if (counts[c] > 0) {
+            for (size_t j = 0; j < d; j++) {
+                centroids.cell(c, j) = sums[c * d + j] / counts[c];
+            }
+        }
+    }
+    const float eps = 1.0 / 1024;
+    for (size_t c = 0; c < k; c++) {
+        if (counts[c] > 0) {
+            continue;
+        }
+        size_t largest = std::max_element(counts.begin(), counts.end()) - counts.begin();
+        for (size_t j = 0; j < d; j++) {
+            float sign = j % 2 ? 1 : -1;
+            centroids.cell(c, j) = centroids.cell(largest, j) * (1 + sign * eps);
+            centroids.cell(largest, j) *= 1 - sign * eps;
+        }
+        counts[c] = counts[largest] / 2;
+        counts[largest] -= counts[c];
     }
+}
 
-    for (size_t i = 0; i < data_matrix.vector_count(); i++) {
-        scale(data_matrix.row(i), maxnorm / U, dim);
+// Moves every centroid towards rows of random batches, with learning rate
+// 1 / (rows assigned to it so far).
+static void mini_batch_kmeans(const FloatMatrix& sample, FloatMatrix& centroids,
+        const KmeansParams& params, std::mt19937& gen) {
+    size_t n = sample.vector_count(), d = sample.vector_length;
+    size_t batch = std::min(params.batch_size, n);
+    std::vector<size_t> counts(centroids.vector_count(), 0);
+    std::vector<float> rows(batch * d);
+    std::vector<faiss::Index::idx_t> labels;
+    std::vector<float> dist;
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    for (size_t it = 0; it < params.iterations; it++) {
+        for (size_t b = 0; b < batch; b++) {
+            memcpy(rows.data() + b * d, sample.row(pick(gen)), d * sizeof(float));
+        }
+        assign_to_centroids(centroids, rows.data(), batch, labels, dist);
+        for (size_t b = 0; b < batch; b++) {
+            float* centroid = centroids.row(labels[b]);
+            const float* row = rows.data() + b * d;
+            float eta = 1.0f / ++counts[labels[b]];
+            for (size_t j = 0; j < d; j++) {
+                centroid[j] += eta * (row[j] - centroid[j]);
+            }
+        }
+    }
+}
 
-        float vec_norm = sqrt(faiss::fvec_norm_L2sqr(data_matrix.row(i), dim));
-        for (size_t j = dim; j < dim + m; j++) {
-            data_matrix.at(i, j) = 0.5 - vec_norm;
-            vec_norm *= vec_norm;
+kmeans_result perform_kmeans(const FlatMatrix<float>& matrix, size_t k, const KmeansParams& params) {
+    size_t n = matrix.vector_count(), d = matrix.vector_length;
+    if (k == 0 || n < k) {
+        throw std::invalid_argument("k-means needs at least as many rows as centroids");
+    }
+    std::mt19937 gen(params.seed);
+    size_t sample_size = params.sample_size ? params.sample_size : params.max_points_per_centroid * k;
+    bool whole = sample_size == 0 || sample_size >= n;
+    FloatMatrix sampled;
+    if (!whole) {
+        sampled = sample_rows(matrix.data.data(), n, d, std::max(sample_size, k), gen());
+    }
+    const FloatMatrix& sample = whole ? matrix : sampled;
+
+    kmeans_result kr;
+    kr.centroids = init_centroids(sample, k, params, gen);
+    std::vector<faiss::Index::idx_t> labels, previous;
+    std::vector<float> dist;
+    if (params.batch_size > 0) {
+        mini_batch_kmeans(sample, kr.centroids, params, gen);
+        whole = false;
+    } else {
+        // Every iteration ends with an assignment, so the last one is valid
+        // for the final centroids.
+        assign_to_centroids(kr.centroids, sample.data.data(), sample.vector_count(), labels, dist);
+        for (size_t it = 0; it < params.iterations; it++) {
+            update_centroids(sample, labels, kr.centroids);
+            previous.swap(labels);
+            assign_to_centroids(kr.centroids, sample.data.data(), sample.vector_count(), labels, dist);
+            if (labels == previous) {
+                break;
+            }
         }
     }
-    return data_matrix;
+    if (!whole) {
+        assign_to_centroids(kr.centroids, matrix.data.data(), n, labels, dist);
+    }
+    kr.assignments.assign(labels.begin(), labels.end());
+    return kr;
 }
 
-static FloatMatrix generic_extend_queries(const float* data, size_t nvecs, size_t dim, size_t m) {
-    FloatMatrix queries;
-    queries.resize(nvecs, dim + m);
-    for (size_t i = 0; i < nvecs; i++) {
-        memcpy(queries.row(i), data + i * dim, dim * sizeof(float));
+FloatMatrix sample_rows(const float* data, size_t n, size_t dim, size_t count, unsigned seed) {
+    if (count == 0 || count > n) {
+        count = n;
+    }
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::mt19937 gen(seed);
+    // Partial Fisher-Yates shuffle picks count distinct rows.
+    if (count < n) {
+        for (size_t i = 0; i < count; i++) {
+            std::uniform_int_distribution<size_t> pick(i, n - 1);
+            std::swap(order[i], order[pick(gen)]);
+        }
+        std::sort(order.begin(), order.begin() + count);
     }
-    for (size_t i = 0; i < queries.vector_count(); i++) {
-        float qnorm = sqrt(faiss::fvec_norm_L2sqr(queries.row(i), dim));
-        scale(queries.row(i), qnorm, dim);
+    FloatMatrix sample;
+    sample.resize(count, dim);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(sample.row(i), data + order[i] * dim, dim * sizeof(float));
+    }
+    return sample;
+}
+
+bool parse_number(const char*& p, const char* end, double& value) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
 
-        for (size_t j = dim; j < dim + m; j++) {
-            queries.at(i, j) = 0.0;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    // Up to 18 significant digits are kept exactly, more only make the
+    // mantissa too large for the fast path below.
+    const uint64_t mantissa_limit = 100000000000000000ULL;
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool any_digits = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (mantissa < mantissa_limit) {
+            mantissa = mantissa * 10 + (*p - '0');
+        } else {
+            exponent++;
+        }
+        any_digits = true;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (mantissa < mantissa_limit) {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+            any_digits = true;
+        }
+    }
+    if (!any_digits) {
+        // inf, nan and the like.
+        char token[64];
+        size_t len = 0;
+        for (p = start; p < end && len + 1 < sizeof(token) && !isspace((unsigned char) *p); p++) {
+            token[len++] = *p;
+        }
+        token[len] = 0;
+        char* parsed;
+        value = strtod(token, &parsed);
+        p = start + (parsed - token);
+        return parsed != token;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* exponent_start = p;
+        p++;
+        bool exponent_negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exponent_negative = *p == '-';
+            p++;
+        }
+        if (p < end && *p >= '0' && *p <= '9') {
+            int e = 0;
+            for (; p < end && *p >= '0' && *p <= '9'; p++) {
+                e = std::min(e * 10 + (*p - '0'), 100000);
+            }
+            exponent += exponent_negative ? -e : e;
+        } else {
+            p = exponent_start;
         }
     }
-    return queries;
+
+    if (mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) {
+        // Rare in datasets, strtod rounds these correctly.
+        value = strtod(std::string(start, p).c_str(), nullptr);
+        return true;
+    }
+    // The mantissa and the power of ten are exact doubles, so the single
+    // rounding of the product or quotient is the correct one.
+    value = mantissa;
+    if (exponent > 0) {
+        value *= powers_of_ten[exponent];
+    } else if (exponent < 0) {
+        value /= powers_of_ten[-exponent];
+    }
+    if (negative) {
+        value = -value;
+    }
+    return true;
 }
 
-static FloatMatrix neyshabur_extend(const float* data, size_t nvecs, size_t dim) {
-    FloatMatrix data_matrix;
-    data_matrix.resize(nvecs, dim + 1);
-    for (size_t i = 0; i < nvecs; i++) {
-        memcpy(data_matrix.row(i), data + i * dim, dim * sizeof(float));
+MappedFile::MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open file " + filename);
     }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Failed to stat file " + filename);
+    }
+    size = st.st_size;
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        throw std::runtime_error("Failed to map file " + filename);
+    }
+    data = (const char*) ptr;
+}
 
-    double maxnorm = 0;
-    for (size_t i = 0; i < data_matrix.vector_count(); i++) {
-        maxnorm = std::max(maxnorm, sqrt(faiss::fvec_norm_L2sqr(data_matrix.row(i), dim)));
+MappedFile::~MappedFile() {
+    munmap((void*) data, size);
+}
+
+static SimdLevel detect_simd_level() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return __builtin_cpu_supports("avx512vnni") ? SIMD_AVX512_VNNI : SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+            && __builtin_cpu_supports("f16c")) {
+        return SIMD_AVX2;
     }
+    return SIMD_NONE;
+}
 
-    for (size_t i = 0; i < data_matrix.vector_count(); i++) {
-        scale(data_matrix.row(i), maxnorm, dim);
+SimdLevel simd_level() {
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
 
-        float norm_sqr = faiss::fvec_norm_L2sqr(data_matrix.row(i), dim);
-        data_matrix.at(i, dim) = sqrt(1 - norm_sqr);
+RandomRotation::RandomRotation(size_t d_in, unsigned seed): d_in(d_in), d_out(1) {
+    while (d_out < d_in) {
+        d_out *= 2;
+    }
+    std::mt19937 gen(seed);
+    permutation.resize(d_out);
+    for (size_t i = 0; i < d_out; i++) {
+        permutation[i] = i;
+    }
+    std::shuffle(permutation.begin(), permutation.end(), gen);
+    signs.resize(d_out);
+    std::bernoulli_distribution coin;
+    for (auto& sign: signs) {
+        sign = coin(gen) ? 1.0f : -1.0f;
     }
-    return data_matrix;
 }
 
-MipsAugmentation::MipsAugmentation(size_t dim, size_t m):
-    dim(dim), m(m) {}
+void RandomRotation::apply(const float* x, float* out) const {
+    // Permuted output slots beyond d_in stay zero.
+    std::fill(out, out + d_out, 0.0f);
+    for (size_t i = 0; i < d_in; i++) {
+        out[permutation[i]] = x[i] * signs[permutation[i]];
+    }
+    // In-place fast Walsh-Hadamard transform.
+    for (size_t h = 1; h < d_out; h *= 2) {
+        for (size_t i = 0; i < d_out; i += 2 * h) {
+            for (size_t j = i; j < i + h; j++) {
+                float a = out[j], b = out[j + h];
+                out[j] = a + b;
+                out[j + h] = a - b;
+            }
+        }
+    }
+    scale(out, sqrt(float(d_out)), d_out);
+}
 
-MipsAugmentationShrivastava::MipsAugmentationShrivastava(size_t dim, size_t m, float U):
-    MipsAugmentation(dim, m), U(U) {}
+FloatMatrix RandomRotation::apply(const float* x, size_t n) const {
+    FloatMatrix result;
+    result.resize(n, d_out);
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++) {
+        apply(x + i * d_in, result.row(i));
+    }
+    return result;
+}
+
+static float scale_copy_ref(const float* x, float alpha, float* out, size_t size) {
+    float norm_sqr = 0;
+    for (size_t i = 0; i < size; i++) {
+        out[i] = x[i] * alpha;
+        norm_sqr += out[i] * out[i];
+    }
+    return norm_sqr;
+}
 
-FloatMatrix MipsAugmentationShrivastava::extend(const float* data, size_t nvecs) {
-    return shrivastava_extend(data, nvecs, dim, m, U);
+__attribute__((target("avx2,fma")))
+static float scale_copy_avx2(const float* x, float alpha, float* out, size_t size) {
+    __m256 a = _mm256_set1_ps(alpha);
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(x + i), a);
+        _mm256_storeu_ps(out + i, v);
+        acc = _mm256_fmadd_ps(v, v, acc);
+    }
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum) + scale_copy_ref(x + i, alpha, out + i, size - i);
 }
 
-FloatMatrix MipsAugmentationShrivastava::extend_queries(const float* data, size_t nvecs) {
-    return generic_extend_queries(data, nvecs, dim, m);
+float scale_copy(const float* x, float alpha, float* out, size_t size) {
+    if (simd_level() != SIMD_NONE) {
+        return scale_copy_avx2(x, alpha, out, size);
+    }
+    return scale_copy_ref(x, alpha, out, size);
 }
 
-MipsAugmentationNeyshabur::MipsAugmentationNeyshabur(size_t dim):
-    MipsAugmentation(dim, 1) {}
+void scale(float* vec, float alpha, size_t size) {
+    scale_copy(vec, 1 / alpha, vec, size);
+}
+
+MipsAugmentation::MipsAugmentation(size_t dim, size_t m):
+    dim(dim), m(m), maxnorm(0) {}
+
+void MipsAugmentation::train(const float* data, size_t nvecs) {
+    float max_sqr = 0;
+    #pragma omp parallel for reduction(max: max_sqr)
+    for (size_t i = 0; i < nvecs; i++) {
+        max_sqr = std::max(max_sqr, faiss::fvec_norm_L2sqr(data + i * dim, dim));
+    }
+    maxnorm = sqrt(max_sqr);
+}
 
-FloatMatrix MipsAugmentationNeyshabur::extend(const float* data, size_t nvecs) {
-    return neyshabur_extend(data, nvecs, dim);
+void MipsAugmentation::extend_queries_into(const float* data, size_t nvecs, float* out) const {
+    size_t len = dim + m;
+    #pragma omp parallel for
+    for (size_t i = 0; i < nvecs; i++) {
+        const float* x = data + i * dim;
+        float* row = out + i * len;
+        float qnorm = sqrt(faiss::fvec_norm_L2sqr(x, dim));
+        scale_copy(x, qnorm > 0 ? 1 / qnorm : 0, row, dim);
+        std::fill(row + dim, row + len, 0.0f);
+    }
 }
 
-FloatMatrix MipsAugmentationNeyshabur::extend_queries(const float* data, size_t nvecs) {
-    return generic_extend_queries(data, nvecs, dim, m);
+FloatMatrix MipsAugmentation::extend(const float* data, size_t nvecs) {
+    if (maxnorm == 0) {
+        train(data, nvecs);
+    }
+    FloatMatrix result;
+    result.resize(nvecs, dim + m);
+    extend_into(data, nvecs, result.data.data());
+    return result;
 }
 
-MipsAugmentationNone::MipsAugmentationNone(size_t dim):
-    MipsAugmentation(dim, 0) {}
+FloatMatrix MipsAugmentation::extend_queries(const float* data, size_t nvecs) const {
+    FloatMatrix result;
+    result.resize(nvecs, dim + m);
+    extend_queries_into(data, nvecs, result.data.data());
+    return result;
+}
 
-FloatMatrix MipsAugmentationNone::extend(const float* data, size_t nvecs) {
-    FloatMatrix data_matrix;
-    data_matrix.resize(nvecs, dim);
-    memcpy(data_matrix.data.data(), data, nvecs * dim * sizeof(float));
+MipsAugmentationShrivastava::MipsAugmentationShrivastava(size_t dim, size_t m, float U):
+    MipsAugmentation(dim, m), U(U) {}
 
-    double maxnorm = 0;
-    for (size_t i = 0; i < data_matrix.vector_count(); i++) {
-        maxnorm = std::max(maxnorm, sqrt(faiss::fvec_norm_L2sqr(data_matrix.row(i), dim)));
+void MipsAugmentationShrivastava::extend_into(const float* data, size_t nvecs, float* out) const {
+    size_t len = dim + m;
+    float alpha = maxnorm > 0 ? U / maxnorm : 1;
+    #pragma omp parallel for
+    for (size_t i = 0; i < nvecs; i++) {
+        float* row = out + i * len;
+        float vec_norm = sqrt(scale_copy(data + i * dim, alpha, row, dim));
+        for (size_t j = dim; j < len; j++) {
+            row[j] = 0.5 - vec_norm;
+            vec_norm *= vec_norm;
+        }
     }
+}
+
+MipsAugmentationNeyshabur::MipsAugmentationNeyshabur(size_t dim):
+    MipsAugmentation(dim, 1) {}
 
-    for (size_t i = 0; i < data_matrix.vector_count(); i++) {
-        scale(data_matrix.row(i), maxnorm, dim);
+void MipsAugmentationNeyshabur::extend_into(const float* data, size_t nvecs, float* out) const {
+    size_t len = dim + 1;
+    float alpha = maxnorm > 0 ? 1 / maxnorm : 1;
+    #pragma omp parallel for
+    for (size_t i = 0; i < nvecs; i++) {
+        float* row = out + i * len;
+        float norm_sqr = scale_copy(data + i * dim, alpha, row, dim);
+        row[dim] = sqrt(std::max(0.0f, 1 - norm_sqr));
     }
-    return data_matrix;
 }
 
-FloatMatrix MipsAugmentationNone::extend_queries(const float* data, size_t nvecs) {
-    return generic_extend_queries(data, nvecs, dim, m);
+MipsAugmentationNone::MipsAugmentationNone(size_t dim):
+    MipsAugmentation(dim, 0) {}
+
+void MipsAugmentationNone::extend_into(const float* data, size_t nvecs, float* out) const {
+    float alpha = maxnorm > 0 ? 1 / maxnorm : 1;
+    #pragma omp parallel for
+    for (size_t i = 0; i < nvecs; i++) {
+        scale_copy(data + i * dim, alpha, out + i * dim, dim);
+    }
 }
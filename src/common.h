@@ -6,67 +6,250 @@
 #include <string>
 
 
+// Allocator returning memory aligned to 64 bytes, a cache line and an
+// AVX-512 register. Blocks of at least 2 MB are aligned to 2 MB and advised
+// to be backed by transparent huge pages, which saves TLB misses when large
+// matrices are scanned.
+template <typename T>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t n);
+    void deallocate(T* p, size_t n);
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
 template <typename T>
 struct FlatMatrix {
-    std::vector<T> data;
+    FlatMatrix();
+
+    // Rows start stride elements apart. stride is vector_length unless the
+    // matrix was resized with padding, in which case data is not a dense
+    // n x vector_length array.
+    std::vector<T, AlignedAllocator<T>> data;
     size_t vector_length;
+    size_t stride;
 
+    // Bounds-checked.
     T& at(size_t vec, size_t ind);
     const T& at(size_t vec, size_t ind) const;
 
+    // Unchecked, for inner loops. Only asserted in debug builds.
+    T& cell(size_t vec, size_t ind);
+    const T& cell(size_t vec, size_t ind) const;
     T* row(size_t num);
     const T* row(size_t num) const;
 
     size_t vector_count() const;
     void print() const;
-    void resize(size_t cnt, size_t dim);
+    // With pad, every row is padded to a multiple of 64 bytes so that rows
+    // are aligned like data.
+    void resize(size_t cnt, size_t dim, bool pad = false);
 };
 
 typedef FlatMatrix<float> FloatMatrix;
 
+// Read-only view of rows that lie stride elements apart in memory owned
+// by someone else (a FlatMatrix, a mapped file...).
+template <typename T>
+struct MatrixView {
+    MatrixView();
+    MatrixView(const T* data, size_t count, size_t dim, size_t stride);
+    MatrixView(const FlatMatrix<T>& matrix);
+
+    const T* data;
+    size_t count;
+    size_t vector_length;
+    size_t stride;
+
+    const T* row(size_t num) const;
+    size_t vector_count() const;
+};
+
+// Read-only memory mapping of a whole file. Throws std::runtime_error if
+// the file cannot be mapped.
+struct MappedFile {
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    const char* data;
+    size_t size;
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// Reads a text file of row count and dimension followed by one row per
+// line. The file is mapped and parsed in parallel, in line-aligned chunks.
+// Throws std::runtime_error if the file cannot be read or is malformed,
+// including a row count or dimension that is not a non-negative integer.
 template <typename T>
 FlatMatrix<T> load_text_file(std::string filename);
 
+// Parses a decimal number at p, skipping leading spaces and tabs but not
+// line breaks, and moves p past it. Returns false if there is no number.
+// The result is correctly rounded, the same as strtod's. Numbers whose
+// digits exceed 2^53 or whose decimal exponent is beyond 22 are handed to
+// strtod, which is slower.
+bool parse_number(const char*& p, const char* end, double& value);
+
+// Reads a .fvecs (T = float), .ivecs (int) or .bvecs (uint8_t) file.
+// Throws std::runtime_error if the file cannot be read or is malformed.
 template<typename T>
 FlatMatrix<T> load_vecs (std::string filename);
 
+// Matrix mapped from a file without copying. Files named *vecs have every
+// row prefixed by its 4-byte dimension, which the view skips using stride.
+// Other files are in the contiguous format written by convert_vecs: uint32
+// row count and dimension followed by the rows. Throws std::runtime_error
+// if the file cannot be mapped or is malformed.
+template <typename T>
+struct MappedMatrix {
+    explicit MappedMatrix(const std::string& filename);
+
+    MappedFile file;
+    MatrixView<T> view;
+};
+
+// Rewrites a .?vecs file in one pass in the contiguous format, whose rows
+// are dense and can be passed to faiss::Index::add straight from the mapping.
+// Throws std::runtime_error if the row count does not fit the uint32 header.
+template <typename T>
+void convert_vecs(const std::string& vecs_filename, const std::string& filename);
+
+template <typename T>
+FloatMatrix to_float(const MatrixView<T>& view);
+
 struct kmeans_result {
     FloatMatrix centroids;
     std::vector<size_t> assignments;
 };
 
-kmeans_result perform_kmeans(const FloatMatrix& matrix, size_t k);
+enum KmeansInit {
+    // k distinct random rows.
+    KMEANS_RANDOM,
+    // k-means++: every next centroid is a row drawn with probability
+    // proportional to its squared distance to the closest centroid so far.
+    KMEANS_PLUS_PLUS,
+    // Greedy k-means++: of 2 + log(k) such draws, the one that lowers the
+    // total squared distance most.
+    // Both k-means++ variants seed on a random subset of at most 16 rows per
+    // centroid of the training sample.
+    KMEANS_GREEDY,
+};
+
+struct KmeansParams {
+    KmeansParams();
 
+    // Lloyd iterations, or mini-batch updates if batch_size is positive.
+    size_t iterations;
+    // Centroids are trained on a random sample of this many rows, 0 for
+    // max_points_per_centroid * k rows.
+    size_t sample_size;
+    size_t max_points_per_centroid;
+    // If positive, centroids are moved towards batch_size random sample rows
+    // at a time with per-centroid learning rates (mini-batch k-means).
+    size_t batch_size;
+    // KMEANS_RANDOM by default, as in faiss.
+    KmeansInit init;
+    unsigned seed;
+};
+
+// Clusters rows of matrix into k centroids and assigns every row to the
+// closest one. Lloyd iterations stop early when no assignment changes;
+// when the whole matrix was the training sample, the assignments of the
+// last iteration are returned without another pass. Throws
+// std::invalid_argument if there are fewer rows than centroids.
+kmeans_result perform_kmeans(const FloatMatrix& matrix, size_t k,
+        const KmeansParams& params = KmeansParams());
+
+// count distinct rows of the n x dim matrix data picked at random, in their
+// original order. All rows if count is 0 or at least n.
+FloatMatrix sample_rows(const float* data, size_t n, size_t dim, size_t count, unsigned seed = 1234);
 
+
+// Divides vec by alpha.
 void scale(float* vec, float alpha, size_t size);
 
+// Writes x * alpha to out, which may be x, and returns the squared norm of
+// the result. Norm and scaling take a single pass.
+float scale_copy(const float* x, float alpha, float* out, size_t size);
+
+enum SimdLevel {
+    SIMD_NONE,
+    // AVX2, FMA and F16C.
+    SIMD_AVX2,
+    // AVX-512 F and BW.
+    SIMD_AVX512,
+    SIMD_AVX512_VNNI,
+};
 
+// Best instruction set supported by the CPU, detected once.
+SimdLevel simd_level();
+
+// Random orthogonal transform x -> H D P x / sqrt(d_out), with a permutation
+// P, random signs D and the Walsh-Hadamard matrix H. Vectors are padded with
+// zeros to d_out, the next power of two, so inner products are preserved and
+// the transform is applied in O(d log d).
+struct RandomRotation {
+    explicit RandomRotation(size_t d_in = 0, unsigned seed = 1234);
+    // out has d_out elements.
+    void apply(const float* x, float* out) const;
+    FloatMatrix apply(const float* x, size_t n) const;
+
+    size_t d_in, d_out;
+    std::vector<size_t> permutation;
+    std::vector<float> signs;
+};
+
+
+// Reduction of MIPS to nearest neighbour search by appending m coordinates.
+// Data are scaled by a constant fixed by train(), so that vectors added in
+// several batches are scaled alike; extend() trains on its first batch if
+// train() was not called. Queries are normalized.
 struct MipsAugmentation {
     MipsAugmentation(size_t dim, size_t m);
-    virtual FloatMatrix extend(const float* data, size_t nvecs) = 0;
-    virtual FloatMatrix extend_queries(const float* data, size_t nvecs) = 0;
+    virtual ~MipsAugmentation() {}
+    // Fixes maxnorm to the largest norm in data.
+    void train(const float* data, size_t nvecs);
+    // Write nvecs rows of dim + m elements to out.
+    virtual void extend_into(const float* data, size_t nvecs, float* out) const = 0;
+    void extend_queries_into(const float* data, size_t nvecs, float* out) const;
+
+    FloatMatrix extend(const float* data, size_t nvecs);
+    FloatMatrix extend_queries(const float* data, size_t nvecs) const;
+
     size_t dim;
-       size_t m;
+    size_t m;
+    // Largest data norm, 0 until trained.
+    float maxnorm;
 };
 
 struct MipsAugmentationShrivastava: public MipsAugmentation {
     MipsAugmentationShrivastava(size_t dim, size_t m, float U = 0.8);
-    FloatMatrix extend(const float* data, size_t nvecs);
-    FloatMatrix extend_queries(const float* data, size_t nvecs);
+    void extend_into(const float* data, size_t nvecs, float* out) const;
 
     float U;
 };
 
+// Vectors longer than maxnorm get 0 as the appended coordinate.
 struct MipsAugmentationNeyshabur: public MipsAugmentation {
     MipsAugmentationNeyshabur(size_t dim);
-    FloatMatrix extend(const float* data, size_t nvecs);
-    FloatMatrix extend_queries(const float* data, size_t nvecs);
+    void extend_into(const float* data, size_t nvecs, float* out) const;
 };
 
 struct MipsAugmentationNone: public MipsAugmentation {
     MipsAugmentationNone(size_t dim);
-    FloatMatrix extend(const float* data, size_t nvecs);
-    FloatMatrix extend_queries(const float* data, size_t nvecs);
+    void extend_into(const float* data, size_t nvecs, float* out) const;
 };
 
 
@@ -3,17 +3,108 @@
 #include <fstream>
 #include <iostream>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <new>
+#include <sys/mman.h>
 
 
+static inline const char* skip_line(const char* p, const char* end) {
+    const char* line_end = (const char*) memchr(p, '\n', end - p);
+    return line_end ? line_end + 1 : end;
+}
+
+static inline bool is_blank_line(const char* p, const char* end) {
+    for (; p < end && *p != '\n'; p++) {
+        if (*p != ' ' && *p != '\t' && *p != '\r') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses a non-negative integer, which may be written like any number.
+static inline bool parse_count(const char*& p, const char* end, size_t& count) {
+    double value;
+    // Integers up to 2^53 are exact doubles.
+    if (!parse_number(p, end, value) || !(value >= 0 && value <= 9007199254740992.0)
+            || value != std::floor(value)) {
+        return false;
+    }
+    count = size_t(value);
+    return true;
+}
+
 template <typename T>
 FlatMatrix<T> load_text_file(std::string filename) {
-    FlatMatrix<T> matrix;
-    std::ifstream infile(filename);
+    MappedFile file(filename);
+    const char* begin = file.data;
+    const char* end = begin + file.size;
+
     size_t cnt, dim;
-    infile >> cnt >> dim;
+    if (!parse_count(begin, end, cnt) || !parse_count(begin, end, dim) || dim < 1
+            || cnt > std::numeric_limits<size_t>::max() / sizeof(T) / dim) {
+        throw std::runtime_error("Failed to read header of " + filename);
+    }
+    begin = skip_line(begin, end);
+    FlatMatrix<T> matrix;
     matrix.resize(cnt, dim);
-    for (auto& cell: matrix.data) {
-        infile >> cell;
+
+    // Chunks of about 1 MB start at line starts. Rows of every chunk are
+    // counted first to know where the chunk's rows go.
+    size_t chunk_count = (end - begin) / (1 << 20) + 1;
+    std::vector<const char*> bounds(chunk_count + 1, end);
+    bounds[0] = begin;
+    for (size_t c = 1; c < chunk_count; c++) {
+        bounds[c] = std::max(bounds[c - 1], skip_line(begin + (end - begin) * c / chunk_count, end));
+    }
+    std::vector<size_t> first_row(chunk_count + 1, 0);
+    #pragma omp parallel for
+    for (size_t c = 0; c < chunk_count; c++) {
+        size_t rows = 0;
+        for (const char* p = bounds[c]; p < bounds[c + 1]; p = skip_line(p, bounds[c + 1])) {
+            rows += !is_blank_line(p, bounds[c + 1]);
+        }
+        first_row[c + 1] = rows;
+    }
+    for (size_t c = 0; c < chunk_count; c++) {
+        first_row[c + 1] += first_row[c];
+    }
+    if (first_row[chunk_count] != matrix.vector_count()) {
+        throw std::runtime_error("Wrong row count in " + filename);
+    }
+
+    bool failed = false;
+    #pragma omp parallel for reduction(||: failed)
+    for (size_t c = 0; c < chunk_count; c++) {
+        size_t row = first_row[c];
+        const char* chunk_end = bounds[c + 1];
+        for (const char* p = bounds[c]; p < chunk_end; p = skip_line(p, chunk_end)) {
+            if (is_blank_line(p, chunk_end)) {
+                continue;
+            }
+            T* out = matrix.row(row);
+            const char* cur = p;
+            double value;
+            for (size_t i = 0; i < matrix.vector_length; i++) {
+                if (!parse_number(cur, chunk_end, value)) {
+                    failed = true;
+                    break;
+                }
+                out[i] = T(value);
+            }
+            if (!is_blank_line(cur, chunk_end)) {
+                failed = true;
+            }
+            row++;
+        }
+    }
+    if (failed) {
+        throw std::runtime_error("Failed to parse " + filename);
     }
     return matrix;
 }
@@ -22,11 +113,14 @@ template <typename T>
 FlatMatrix<T> load_vecs (std::string filename) {
     std::ifstream infile(filename, std::ios::binary);
     if (infile.fail()) {
-        std::cout << "Failed to open file." << std::endl;
-        exit(1);
+        throw std::runtime_error("Failed to open file " + filename);
     }
+    // An empty file has no dimension, it is rejected like by MappedMatrix.
     uint32_t dim;
     infile.read((char*) &dim, sizeof(dim));
+    if (infile.fail() || dim == 0) {
+        throw std::runtime_error("Wrong file size of " + filename);
+    }
 
     infile.seekg(0, std::ios::end);
     size_t fsz = infile.tellg();
@@ -35,40 +129,164 @@ FlatMatrix<T> load_vecs (std::string filename) {
     size_t row_size = sizeof(T) * dim + sizeof(dim);
     size_t n = fsz / row_size;
     if(fsz != n * row_size){
-        std::cout << "Wrong file size" << std::endl;
-        exit(1);
+        throw std::runtime_error("Wrong file size of " + filename);
     }
     FlatMatrix<T> result;
     result.resize(n, dim);
     for(size_t i = 0; i < n; i++){
         uint32_t rowsz;
         infile.read((char*) &rowsz, sizeof(rowsz));
-        assert(rowsz == dim);
+        if (infile.fail()) {
+            throw std::runtime_error("Failed to read " + filename);
+        }
+        if (rowsz != dim) {
+            throw std::runtime_error("Inconsistent dimensions in " + filename);
+        }
         infile.read((char*) result.row(i), sizeof(T) * rowsz);
+        if (infile.fail()) {
+            throw std::runtime_error("Failed to read " + filename);
+        }
+    }
+    return result;
+}
+
+static inline bool is_vecs_file(const std::string& filename) {
+    return filename.size() >= 4 && filename.compare(filename.size() - 4, 4, "vecs") == 0;
+}
+
+template <typename T>
+MappedMatrix<T>::MappedMatrix(const std::string& filename): file(filename) {
+    uint32_t dim;
+    if (is_vecs_file(filename)) {
+        if (file.size < sizeof(dim)) {
+            throw std::runtime_error("Wrong file size of " + filename);
+        }
+        memcpy(&dim, file.data, sizeof(dim));
+        size_t row_size = sizeof(T) * dim + sizeof(dim);
+        if (dim == 0 || file.size % row_size != 0 || row_size % sizeof(T) != 0) {
+            throw std::runtime_error("Wrong file size of " + filename);
+        }
+        size_t n = file.size / row_size;
+        // Checking every header would touch all pages, only the last one is
+        // checked.
+        uint32_t last_dim;
+        memcpy(&last_dim, file.data + (n - 1) * row_size, sizeof(last_dim));
+        if (last_dim != dim) {
+            throw std::runtime_error("Inconsistent dimensions in " + filename);
+        }
+        view = MatrixView<T>((const T*) (file.data + sizeof(dim)), n, dim, row_size / sizeof(T));
+    } else {
+        uint32_t n;
+        if (file.size < 2 * sizeof(uint32_t)) {
+            throw std::runtime_error("Wrong file size of " + filename);
+        }
+        memcpy(&n, file.data, sizeof(n));
+        memcpy(&dim, file.data + sizeof(n), sizeof(dim));
+        if (file.size != 2 * sizeof(uint32_t) + size_t(n) * dim * sizeof(T)) {
+            throw std::runtime_error("Wrong file size of " + filename);
+        }
+        view = MatrixView<T>((const T*) (file.data + 2 * sizeof(uint32_t)), n, dim, dim);
+    }
+}
+
+template <typename T>
+void convert_vecs(const std::string& vecs_filename, const std::string& filename) {
+    MappedMatrix<T> input(vecs_filename);
+    size_t n = input.view.vector_count(), dim = input.view.vector_length;
+    if (n > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Too many rows for the header of " + filename);
+    }
+    std::ofstream outfile(filename, std::ios::binary);
+    uint32_t header[2] = {uint32_t(n), uint32_t(dim)};
+    outfile.write((const char*) header, sizeof(header));
+    // Rows are packed into blocks of about 4 MB, one write each.
+    size_t block = std::max<size_t>(1, (4 << 20) / (dim * sizeof(T)));
+    std::vector<T> buffer(std::min(block, n) * dim);
+    for (size_t begin = 0; begin < n; begin += block) {
+        size_t count = std::min(block, n - begin);
+        for (size_t i = 0; i < count; i++) {
+            memcpy(buffer.data() + i * dim, input.view.row(begin + i), dim * sizeof(T));
+        }
+        outfile.write((const char*) buffer.data(), count * dim * sizeof(T));
+    }
+    if (outfile.fail()) {
+        throw std::runtime_error("Failed to write file " + filename);
+    }
+}
+
+template <typename T>
+FloatMatrix to_float(const MatrixView<T>& view) {
+    FloatMatrix result;
+    result.resize(view.vector_count(), view.vector_length);
+    for (size_t i = 0; i < view.vector_count(); i++) {
+        const T* row = view.row(i);
+        std::copy(row, row + view.vector_length, result.row(i));
     }
     return result;
 }
 
+template <typename T>
+T* AlignedAllocator<T>::allocate(size_t n) {
+    const size_t huge_page = 2 << 20;
+    size_t bytes = n * sizeof(T);
+    void* p = nullptr;
+    if (posix_memalign(&p, bytes >= huge_page ? huge_page : 64, bytes) != 0) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (bytes >= huge_page) {
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return (T*) p;
+}
+
+template <typename T>
+void AlignedAllocator<T>::deallocate(T* p, size_t) {
+    free(p);
+}
+
+template <typename T>
+FlatMatrix<T>::FlatMatrix(): vector_length(0), stride(0) {}
+
 template <typename T>
 size_t FlatMatrix<T>::vector_count() const {
-    return data.size() / vector_length;
+    return stride ? data.size() / stride : 0;
 }
 
 template <typename T>
 T& FlatMatrix<T>::at(size_t vec, size_t ind) {
-    return data.at(vec * vector_length + ind);
+    if (ind >= vector_length) {
+        throw std::out_of_range("FlatMatrix::at");
+    }
+    return data.at(vec * stride + ind);
 }
 
 template <typename T>
 const T& FlatMatrix<T>::at(size_t vec, size_t ind) const {
-    return data.at(vec * vector_length + ind);
+    if (ind >= vector_length) {
+        throw std::out_of_range("FlatMatrix::at");
+    }
+    return data.at(vec * stride + ind);
+}
+
+template <typename T>
+T& FlatMatrix<T>::cell(size_t vec, size_t ind) {
+    assert(ind < vector_length && vec * stride + ind < data.size());
+    return data[vec * stride + ind];
+}
+
+template <typename T>
+const T& FlatMatrix<T>::cell(size_t vec, size_t ind) const {
+    assert(ind < vector_length && vec * stride + ind < data.size());
+    return data[vec * stride + ind];
 }
 
 template <typename T>
 void FlatMatrix<T>::print() const {
     for (size_t vec = 0; vec < vector_count(); vec++) {
         for (size_t i = 0; i < vector_length; i++) {
-            std::cout << at(vec, i) << " ";
+            std::cout << cell(vec, i) << " ";
         }
         std::cout << std::endl;
     }
@@ -76,16 +294,44 @@ void FlatMatrix<T>::print() const {
 
 template <typename T>
 T* FlatMatrix<T>::row(size_t num) {
-    return &at(num, 0);
+    assert(num < vector_count());
+    return data.data() + num * stride;
 }
 
 template <typename T>
 const T* FlatMatrix<T>::row(size_t num) const {
-    return &at(num, 0);
+    assert(num < vector_count());
+    return data.data() + num * stride;
 }
 
 template <typename T>
-void FlatMatrix<T>::resize(size_t cnt, size_t dim) {
-    data.resize(cnt * dim);
+void FlatMatrix<T>::resize(size_t cnt, size_t dim, bool pad) {
+    size_t align = 64 / sizeof(T);
+    size_t new_stride = pad && align > 1 ? (dim + align - 1) / align * align : dim;
+    data.resize(cnt * new_stride);
     vector_length = dim;
+    stride = new_stride;
+}
+
+template <typename T>
+MatrixView<T>::MatrixView():
+    data(nullptr), count(0), vector_length(0), stride(0) {}
+
+template <typename T>
+MatrixView<T>::MatrixView(const T* data, size_t count, size_t dim, size_t stride):
+    data(data), count(count), vector_length(dim), stride(stride) {}
+
+template <typename T>
+MatrixView<T>::MatrixView(const FlatMatrix<T>& matrix):
+    data(matrix.data.data()), count(matrix.vector_count()),
+    vector_length(matrix.vector_length), stride(matrix.stride) {}
+
+template <typename T>
+const T* MatrixView<T>::row(size_t num) const {
+    return data + num * stride;
+}
+
+template <typename T>
+size_t MatrixView<T>::vector_count() const {
+    return count;
 }
@@ -0,0 +1,144 @@
+#include "fastscan.h"
+
+#include "common.h"
+#include "topk.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+void pack_fast_scan_codes(const uint8_t* codes, size_t begin, size_t end, size_t subspace_count,
+        vector<uint8_t>& blocks) {
+    size_t code_size = (subspace_count + 1) / 2;
+    size_t block_size = fast_scan_block_size(subspace_count);
+    size_t nblocks = (end + fast_scan_block - 1) / fast_scan_block;
+    // Padding of a partial last block is zero, so new codes are or-ed in.
+    blocks.resize(nblocks * block_size, 0);
+    for (size_t vec = begin; vec < end; vec++) {
+        const uint8_t* code = codes + (vec - begin) * code_size;
+        uint8_t* block = blocks.data() + vec / fast_scan_block * block_size;
+        size_t j = vec % fast_scan_block;
+        for (size_t part = 0; part < subspace_count; part++) {
+            size_t value = (code[part >> 1] >> ((part & 1) << 2)) & 0xf;
+            block[(part >> 1) * 32 + (part & 1) * 16 + (j & 15)] |= value << (j < 16 ? 0 : 4);
+        }
+    }
+}
+
+void quantize_lut(const float* table, size_t subspace_count, size_t centroid_count,
+        uint8_t* lut, float& scale, float& bias) {
+    // A common scale keeps the quantized entries of different subspaces
+    // additive, per-subspace minimums only shift the sum.
+    vector<float> mins(subspace_count);
+    float max_range = 0;
+    bias = 0;
+    for (size_t part = 0; part < subspace_count; part++) {
+        const float* row = table + part * centroid_count;
+        float lo = *min_element(row, row + centroid_count);
+        float hi = *max_element(row, row + centroid_count);
+        mins[part] = lo;
+        max_range = max(max_range, hi - lo);
+        bias += lo;
+    }
+    scale = max_range > 0 ? max_range / 255 : 1;
+
+    memset(lut, 0, fast_scan_block_size(subspace_count));
+    for (size_t part = 0; part < subspace_count; part++) {
+        const float* row = table + part * centroid_count;
+        uint8_t* out = lut + (part >> 1) * 32 + (part & 1) * 16;
+        for (size_t j = 0; j < centroid_count; j++) {
+            float q = roundf((row[j] - mins[part]) / scale);
+            out[j] = uint8_t(min(255.0f, max(0.0f, q)));
+        }
+    }
+}
+
+static void fast_scan_accumulate_ref(const uint8_t* block, size_t subspace_count,
+        const uint8_t* lut, uint16_t* out) {
+    uint32_t sums[fast_scan_block] = {};
+    size_t groups = (subspace_count + 1) / 2;
+    for (size_t half = 0; half < groups * 2; half++) {
+        const uint8_t* codes = block + half * 16;
+        const uint8_t* table = lut + half * 16;
+        for (size_t j = 0; j < 16; j++) {
+            sums[j] += table[codes[j] & 0xf];
+            sums[j + 16] += table[codes[j] >> 4];
+        }
+    }
+    for (size_t j = 0; j < fast_scan_block; j++) {
+        out[j] = min(sums[j], 65535u);
+    }
+}
+
+__attribute__((target("avx2")))
+static void fast_scan_accumulate_avx2(const uint8_t* block, size_t subspace_count,
+        const uint8_t* lut, uint16_t* out) {
+    const __m256i mask = _mm256_set1_epi8(0xf);
+    const __m256i zero = _mm256_setzero_si256();
+    // Lane 0 of the accumulators sums even subspaces, lane 1 odd ones.
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    size_t groups = (subspace_count + 1) / 2;
+    for (size_t group = 0; group < groups; group++) {
+        __m256i table = _mm256_loadu_si256((const __m256i*) (lut + group * 32));
+        __m256i codes = _mm256_loadu_si256((const __m256i*) (block + group * 32));
+        __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(codes, mask));
+        __m256i hi = _mm256_shuffle_epi8(table,
+                _mm256_and_si256(_mm256_srli_epi16(codes, 4), mask));
+        acc0 = _mm256_adds_epu16(acc0, _mm256_unpacklo_epi8(lo, zero));
+        acc1 = _mm256_adds_epu16(acc1, _mm256_unpackhi_epi8(lo, zero));
+        acc2 = _mm256_adds_epu16(acc2, _mm256_unpacklo_epi8(hi, zero));
+        acc3 = _mm256_adds_epu16(acc3, _mm256_unpackhi_epi8(hi, zero));
+    }
+    __m256i acc[4] = {acc0, acc1, acc2, acc3};
+    for (size_t i = 0; i < 4; i++) {
+        __m128i sum = _mm_adds_epu16(_mm256_castsi256_si128(acc[i]),
+                _mm256_extracti128_si256(acc[i], 1));
+        _mm_storeu_si128((__m128i*) (out + i * 8), sum);
+    }
+}
+
+void fast_scan_accumulate(const uint8_t* block, size_t subspace_count,
+        const uint8_t* lut, uint16_t* out) {
+    if (simd_level() != SIMD_NONE) {
+        fast_scan_accumulate_avx2(block, subspace_count, lut, out);
+    } else {
+        fast_scan_accumulate_ref(block, subspace_count, lut, out);
+    }
+}
+
+vector<size_t> fast_scan_candidates(const uint8_t* blocks, size_t n, size_t subspace_count,
+        const float* table, size_t centroid_count, size_t count,
+        const uint8_t* norm_codes, const float* norm_table) {
+    size_t block_size = fast_scan_block_size(subspace_count);
+    vector<uint8_t> lut(block_size);
+    float lut_scale, lut_bias;
+    quantize_lut(table, subspace_count, centroid_count, lut.data(), lut_scale, lut_bias);
+
+    TopK<size_t> top(count);
+    uint16_t sums[fast_scan_block];
+    float scores[fast_scan_block];
+    size_t nblocks = (n + fast_scan_block - 1) / fast_scan_block;
+    for (size_t b = 0; b < nblocks; b++) {
+        fast_scan_accumulate(blocks + b * block_size, subspace_count, lut.data(), sums);
+        size_t first = b * fast_scan_block;
+        size_t block_count = min(fast_scan_block, n - first);
+        for (size_t j = 0; j < block_count; j++) {
+            scores[j] = lut_scale * sums[j] + lut_bias;
+            if (norm_codes) {
+                scores[j] *= norm_table[norm_codes[first + j]];
+            }
+        }
+        top.push_array(scores, block_count, first);
+    }
+
+    vector<size_t> result;
+    result.reserve(top.entries.size());
+    for (const auto& candidate: top.entries) {
+        result.push_back(candidate.second);
+    }
+    return result;
+}
@@ -0,0 +1,96 @@
+#ifndef FASTSCAN_H_
+#define FASTSCAN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Fast-scan of 4-bit subspace codes: lookup tables are quantized to uint8,
+// so that one vpshufb looks up 32 codes at once, and sums are accumulated
+// in uint16 with saturation.
+//
+// Codes are stored in blocks of fast_scan_block vectors. A block holds
+// ceil(subspace_count / 2) groups of 32 bytes; the first 16 bytes of group p
+// are codes of subspace 2p, the next 16 of subspace 2p + 1. Byte j of a half
+// holds the code of vector j in the low nibble and of vector j + 16 in the
+// high nibble.
+const size_t fast_scan_block = 32;
+
+// Bytes per block of fast_scan_block vectors.
+inline size_t fast_scan_block_size(size_t subspace_count) {
+    return (subspace_count + 1) / 2 * 32;
+}
+
+// Converts row-major codes (two subspaces per byte, low nibble first) of
+// vectors [begin, end) to the block layout and appends them to blocks,
+// which hold the first begin vectors. codes starts with the code of vector
+// begin. The last block is padded with zero codes.
+void pack_fast_scan_codes(const uint8_t* codes, size_t begin, size_t end, size_t subspace_count,
+        std::vector<uint8_t>& blocks);
+
+// Code of subspace part of vector j of the given block.
+inline size_t fast_scan_code(const uint8_t* block, size_t j, size_t part) {
+    uint8_t byte = block[(part >> 1) * 32 + (part & 1) * 16 + (j & 15)];
+    return j < 16 ? byte & 0xf : byte >> 4;
+}
+
+// Sum of entries of a subspace_count x centroid_count float table selected
+// by the codes of vector vec of blocks.
+inline float fast_scan_lut_score(const uint8_t* blocks, size_t vec, const float* table,
+        size_t subspace_count, size_t centroid_count) {
+    const uint8_t* block = blocks + vec / fast_scan_block * fast_scan_block_size(subspace_count);
+    size_t j = vec % fast_scan_block;
+    float sum = 0;
+    for (size_t part = 0; part < subspace_count; part++) {
+        sum += table[part * centroid_count + fast_scan_code(block, j, part)];
+    }
+    return sum;
+}
+
+// Quantizes a subspace_count x centroid_count table of floats to
+// fast_scan_block_size(subspace_count) bytes laid out like a block, so that
+// sum of table entries ~ scale * sum of quantized entries + bias.
+void quantize_lut(const float* table, size_t subspace_count, size_t centroid_count,
+        uint8_t* lut, float& scale, float& bias);
+
+// Sums quantized table entries of all vectors of the block into out.
+void fast_scan_accumulate(const uint8_t* block, size_t subspace_count,
+        const uint8_t* lut, uint16_t* out);
+
+// Indices of up to count of the n vectors in blocks with the largest
+// quantized sums of a subspace_count x centroid_count float table, in no
+// particular order. If norm_codes is given, sums of vector i are multiplied
+// by norm_table[norm_codes[i]].
+std::vector<size_t> fast_scan_candidates(const uint8_t* blocks, size_t n, size_t subspace_count,
+        const float* table, size_t centroid_count, size_t count,
+        const uint8_t* norm_codes = nullptr, const float* norm_table = nullptr);
+
+// Sets value of a part of a zero-initialized row-major code.
+inline void set_code(uint8_t* code, size_t part, size_t value, size_t nbits) {
+    if (nbits == 8) {
+        code[part] = value;
+    } else {
+        code[part >> 1] |= value << ((part & 1) << 2);
+    }
+}
+
+// Exact sum of table entries selected by a row-major code of 4-bit (two
+// per byte, low nibble first) or 8-bit values. Subspaces may as well be
+// codebooks of an additive quantizer.
+inline float lut_score(const float* table, const uint8_t* code,
+        size_t subspace_count, size_t centroid_count, size_t nbits) {
+    float sum = 0;
+    if (nbits == 8) {
+        for (size_t part = 0; part < subspace_count; part++) {
+            sum += table[part * centroid_count + code[part]];
+        }
+    } else {
+        for (size_t part = 0; part < subspace_count; part++) {
+            sum += table[part * centroid_count + ((code[part >> 1] >> ((part & 1) << 2)) & 0xf)];
+        }
+    }
+    return sum;
+}
+
+#endif
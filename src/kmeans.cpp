@@ -1,27 +1,44 @@
 #include "kmeans.h"
 
 #include "common.h"
+#include "topk.h"
 
 #include "../faiss/utils.h"
 #include "../faiss/Clustering.h"
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
 #include <cmath>
 #include <ctime>
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <limits>
 
 using namespace std;
 using layer_t = IndexHierarchicKmeans::layer_t;
+using tree_t = IndexHierarchicKmeans::tree_t;
+using delta_chunk_t = IndexHierarchicKmeans::delta_chunk_t;
+using leaf_delta_t = IndexHierarchicKmeans::leaf_delta_t;
+using leaf_t = IndexHierarchicKmeans::leaf_t;
+using idx_t = faiss::Index::idx_t;
 
+// Layer as produced by clustering, before it is flattened into a tree_t.
+struct build_layer_t {
+    kmeans_result kr;
+    vector<vector<size_t>> centroid_children;
+    size_t cluster_num;
+};
 
-static vector<layer_t> make_layers(const FloatMatrix& vectors, size_t L) {
-    vector<layer_t> layers = vector<layer_t>(L);
+static vector<build_layer_t> make_layers(const FloatMatrix& vectors, size_t L,
+        const KmeansParams& params) {
+    vector<build_layer_t> layers = vector<build_layer_t>(L);
 
     for (size_t layer_id = 0; layer_id < L; layer_id++) {
-        layer_t& layer = layers[layer_id];
+        build_layer_t& layer = layers[layer_id];
 
         // Compute number of clusters and cluster size on this layer.
         size_t cluster_size = floor(
@@ -33,7 +50,7 @@ static vector<layer_t> make_layers(const FloatMatrix& vectors, size_t L) {
         const FloatMatrix& points = (layer_id == 0) ?
                vectors : layers[layer_id - 1].kr.centroids;
 
-        layer.kr = perform_kmeans(points, layer.cluster_num);
+        layer.kr = perform_kmeans(points, layer.cluster_num, params);
 
         layer.centroid_children.resize(layer.cluster_num);
         for (size_t i = 0; i < layer.kr.assignments.size(); i++) {
@@ -44,117 +61,1077 @@ static vector<layer_t> make_layers(const FloatMatrix& vectors, size_t L) {
     return layers;
 }
 
-static vector<size_t> predict(const vector<layer_t>& layers, FloatMatrix& queries, size_t qnum,
-        size_t opened_trees, const FloatMatrix& vectors, size_t k_needed = 1) {
+// Index file layout: hkm_header_t, cluster_num of every layer, then
+// 64-byte aligned sections: codec ranges (CODEC_INT8 only), centroid codes
+// and child_offsets of every layer (bottom-up), vector codes,
+// vectors_original and labels.
+static const char hkm_magic[4] = {'H', 'K', 'M', 'I'};
+static const uint32_t hkm_version = 1;
+static const size_t hkm_alignment = 64;
 
-    vector<size_t> candidates;
-    for (size_t i = 0; i < layers.back().cluster_num; i++) {
-        candidates.push_back(i);
+struct hkm_header_t {
+    char magic[4];
+    uint32_t version;
+    uint64_t d;
+    uint64_t vector_length;
+    uint64_t ntotal;
+    uint64_t layers_count;
+    uint64_t opened_trees;
+    // Same numbering as in the benchmarks: 0 - Neyshabur, 1 - Shrivastava, 2 - none.
+    uint32_t augmentation_type;
+    uint32_t augmentation_m;
+    float augmentation_U;
+    uint32_t codec_type;
+    float augmentation_maxnorm;
+    uint32_t reserved;
+};
+
+// Copies the header of an index file image.
+static hkm_header_t read_header(const char* data, size_t size) {
+    hkm_header_t header;
+    if (size < sizeof(header)) {
+        throw runtime_error("Index file too short");
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, hkm_magic, sizeof(hkm_magic)) != 0) {
+        throw runtime_error("Not a hierarchic k-means index file");
+    }
+    if (header.version != hkm_version) {
+        throw runtime_error("Unsupported index file version");
+    }
+    return header;
+}
+
+struct hkm_layout_t {
+    size_t codec_offset;
+    vector<size_t> centroids_offset;
+    vector<size_t> child_offsets_offset;
+    size_t codes_offset;
+    size_t vectors_original_offset;
+    size_t labels_offset;
+    size_t size;
+};
+
+static size_t align_offset(size_t offset) {
+    return (offset + hkm_alignment - 1) / hkm_alignment * hkm_alignment;
+}
+
+// Returns the end of a section of count items at offset, throws if it
+// would end beyond limit.
+static size_t section_end(size_t offset, uint64_t count, size_t item_size, size_t limit) {
+    if (offset > limit || (item_size > 0 && count > (limit - offset) / item_size)) {
+        throw runtime_error("Index file too short");
+    }
+    return offset + count * item_size;
+}
+
+// Offsets of all sections. Throws if the sections would end beyond limit.
+static hkm_layout_t make_layout(const hkm_header_t& header, const uint64_t* cluster_num,
+        size_t limit = numeric_limits<size_t>::max()) {
+    hkm_layout_t layout;
+    size_t code_size = VectorCodec((VectorCodecType) header.codec_type,
+            header.vector_length).code_size();
+    size_t offset = section_end(sizeof(hkm_header_t), header.layers_count,
+            sizeof(uint64_t), limit);
+
+    offset = align_offset(offset);
+    layout.codec_offset = offset;
+    if (header.codec_type == CODEC_INT8) {
+        offset = section_end(offset, 2 * header.vector_length, sizeof(float), limit);
+    }
+
+    for (size_t l = 0; l < header.layers_count; l++) {
+        offset = align_offset(offset);
+        layout.centroids_offset.push_back(offset);
+        offset = section_end(offset, cluster_num[l], code_size, limit);
+
+        offset = align_offset(offset);
+        layout.child_offsets_offset.push_back(offset);
+        offset = section_end(offset, cluster_num[l] + 1, sizeof(uint64_t), limit);
+    }
+    offset = align_offset(offset);
+    layout.codes_offset = offset;
+    offset = section_end(offset, header.ntotal, code_size, limit);
+
+    offset = align_offset(offset);
+    layout.vectors_original_offset = offset;
+    offset = section_end(offset, header.ntotal, header.d * sizeof(float), limit);
+
+    offset = align_offset(offset);
+    layout.labels_offset = offset;
+    offset = section_end(offset, header.ntotal, sizeof(int64_t), limit);
+
+    layout.size = offset;
+    return layout;
+}
+
+// Points tree views into data, which holds an index file image. Also checks
+// that the image is consistent with its header and that child offsets of
+// every layer are valid ranges of the layer below, so that searching a
+// malformed file cannot read out of bounds.
+static void attach_tree(tree_t& tree, const char* data, size_t size) {
+    static_assert(sizeof(size_t) == sizeof(uint64_t), "size_t must be 64-bit");
+    static_assert(sizeof(idx_t) == sizeof(int64_t), "idx_t must be 64-bit");
+
+    hkm_header_t header = read_header(data, size);
+    if (header.codec_type > CODEC_INT8) {
+        throw runtime_error("Unknown vector codec in index file");
+    }
+    // Every dimension takes at least a byte of the file, which also keeps
+    // the sizes below from overflowing.
+    if (header.d == 0 || header.d > header.vector_length || header.vector_length > size) {
+        throw runtime_error("Invalid vector dimensions in index file");
+    }
+    if (header.layers_count == 0) {
+        throw runtime_error("Index file has no layers");
+    }
+    size_t cluster_num_offset = sizeof(hkm_header_t);
+    section_end(cluster_num_offset, header.layers_count, sizeof(uint64_t), size);
+    const uint64_t* cluster_num = (const uint64_t*) (data + cluster_num_offset);
+    hkm_layout_t layout = make_layout(header, cluster_num, size);
+
+    tree.codec = VectorCodec((VectorCodecType) header.codec_type, header.vector_length);
+    if (header.codec_type == CODEC_INT8) {
+        const float* ranges = (const float*) (data + layout.codec_offset);
+        tree.codec.vmin.assign(ranges, ranges + header.vector_length);
+        tree.codec.vdiff.assign(ranges + header.vector_length, ranges + 2 * header.vector_length);
+    }
+
+    tree.layers.resize(header.layers_count);
+    for (size_t l = 0; l < header.layers_count; l++) {
+        layer_t& layer = tree.layers[l];
+        layer.cluster_num = cluster_num[l];
+        layer.centroids = (const uint8_t*) (data + layout.centroids_offset[l]);
+        layer.child_offsets = (const size_t*) (data + layout.child_offsets_offset[l]);
+
+        size_t children = l == 0 ? header.ntotal : cluster_num[l - 1];
+        if (layer.cluster_num == 0 || layer.child_offsets[0] != 0 ||
+                layer.child_offsets[layer.cluster_num] != children) {
+            throw runtime_error("Invalid child offsets in index file");
+        }
+        for (size_t c = 0; c < layer.cluster_num; c++) {
+            if (layer.child_offsets[c] > layer.child_offsets[c + 1]) {
+                throw runtime_error("Invalid child offsets in index file");
+            }
+        }
+    }
+    tree.codes = (const uint8_t*) (data + layout.codes_offset);
+    tree.vectors_original = MatrixView<float>(
+            (const float*) (data + layout.vectors_original_offset),
+            header.ntotal, header.d, header.d);
+    tree.labels = (const idx_t*) (data + layout.labels_offset);
+    tree.storage_data = data;
+    tree.storage_size = size;
+    tree.leaves.resize(cluster_num[0]);
+    for (size_t c = 0; c < cluster_num[0]; c++) {
+        tree.leaves[c].begin = tree.layers[0].child_offsets[c];
+        tree.leaves[c].end = tree.layers[0].child_offsets[c + 1];
     }
+}
 
+static void fill_augmentation_fields(hkm_header_t& header, const MipsAugmentation* aug) {
+    header.augmentation_m = aug->m;
+    header.augmentation_U = 0;
+    header.augmentation_maxnorm = aug->maxnorm;
+    if (dynamic_cast<const MipsAugmentationNeyshabur*>(aug)) {
+        header.augmentation_type = 0;
+    } else if (auto shrivastava = dynamic_cast<const MipsAugmentationShrivastava*>(aug)) {
+        header.augmentation_type = 1;
+        header.augmentation_U = shrivastava->U;
+    } else if (dynamic_cast<const MipsAugmentationNone*>(aug)) {
+        header.augmentation_type = 2;
+    } else {
+        throw runtime_error("Unknown augmentation type");
+    }
+}
+
+// Augmentation described by the header fields.
+static MipsAugmentation* make_augmentation(const hkm_header_t& header) {
+    MipsAugmentation* aug;
+    switch (header.augmentation_type) {
+    case 0: aug = new MipsAugmentationNeyshabur(header.d); break;
+    case 1: aug = new MipsAugmentationShrivastava(header.d, header.augmentation_m,
+                    header.augmentation_U); break;
+    case 2: aug = new MipsAugmentationNone(header.d); break;
+    default: throw runtime_error("Unknown augmentation type in index file");
+    }
+    aug->maxnorm = header.augmentation_maxnorm;
+    return aug;
+}
+
+// Parameters of the index that building a tree reads. rebalance() copies
+// them under update_mutex and builds without it, while train() may change
+// the augmentation and users the parameters.
+struct hkm_build_t {
+    // d, opened_trees and the augmentation fields.
+    hkm_header_t header;
+    shared_ptr<const MipsAugmentation> augmentation;
+    KmeansParams kmeans_params;
+};
+
+static hkm_build_t build_params(const IndexHierarchicKmeans& index) {
+    hkm_build_t build;
+    memset(&build.header, 0, sizeof(build.header));
+    build.header.d = index.d;
+    build.header.opened_trees = index.opened_trees;
+    fill_augmentation_fields(build.header, index.augmentation);
+    build.augmentation.reset(make_augmentation(build.header));
+    build.kmeans_params = index.kmeans_params;
+    return build;
+}
+
+// Orders the layers top-down, so that children of every centroid are
+// contiguous. Returns clustering ids of every layer in tree order, followed
+// by those of the children of layer 0, and fills child offsets of every
+// layer.
+static vector<vector<size_t>> order_layers(const vector<build_layer_t>& layers,
+        vector<vector<size_t>>& child_offsets) {
+    vector<vector<size_t>> orders(layers.size() + 1);
+    child_offsets.assign(layers.size(), vector<size_t>());
+    vector<size_t>& top = orders[layers.size() - 1];
+    for (size_t i = 0; i < layers.back().cluster_num; i++) {
+        top.push_back(i);
+    }
     for (size_t layer_id = layers.size() - 1; layer_id != (size_t)(-1); layer_id--) {
-        vector<std::pair<float, size_t>> best_centroids;
-        for (auto c: candidates) {
-            float result = faiss::fvec_inner_product(
-                    queries.row(qnum), 
-                    layers[layer_id].kr.centroids.row(c),
-                    queries.vector_length);
+        const vector<size_t>& order = orders[layer_id];
+        vector<size_t>& children_order = layer_id > 0 ? orders[layer_id - 1] : orders.back();
+        for (size_t c: order) {
+            child_offsets[layer_id].push_back(children_order.size());
+            const vector<size_t>& children = layers[layer_id].centroid_children[c];
+            children_order.insert(children_order.end(), children.begin(), children.end());
+        }
+        child_offsets[layer_id].push_back(children_order.size());
+    }
+    return orders;
+}
+
+// Orders the clustered layers and writes them into one buffer in index file
+// layout. Labels of vectors default to their row numbers.
+static tree_t make_tree(const hkm_build_t& build, const VectorCodec& codec,
+        const vector<build_layer_t>& layers, const FloatMatrix& vectors,
+        const float* vectors_original, const idx_t* vector_labels = nullptr) {
+    hkm_header_t header = build.header;
+    memcpy(header.magic, hkm_magic, sizeof(hkm_magic));
+    header.version = hkm_version;
+    header.vector_length = vectors.vector_length;
+    header.ntotal = vectors.vector_count();
+    header.layers_count = layers.size();
+    header.codec_type = codec.type;
+    size_t code_size = codec.code_size();
+
+    vector<uint64_t> cluster_num;
+    for (const auto& layer: layers) {
+        cluster_num.push_back(layer.cluster_num);
+    }
+    hkm_layout_t layout = make_layout(header, cluster_num.data());
+
+    void* buffer;
+    if (posix_memalign(&buffer, hkm_alignment, layout.size) != 0) {
+        throw bad_alloc();
+    }
+    tree_t tree;
+    tree.storage = shared_ptr<void>(buffer, free);
+    char* data = (char*) buffer;
+    memset(data, 0, layout.size);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), cluster_num.data(), cluster_num.size() * sizeof(uint64_t));
+    if (codec.type == CODEC_INT8) {
+        float* ranges = (float*) (data + layout.codec_offset);
+        memcpy(ranges, codec.vmin.data(), header.vector_length * sizeof(float));
+        memcpy(ranges + header.vector_length, codec.vdiff.data(),
+                header.vector_length * sizeof(float));
+    }
+
+    vector<vector<size_t>> child_offsets;
+    vector<vector<size_t>> orders = order_layers(layers, child_offsets);
+    for (size_t layer_id = 0; layer_id < layers.size(); layer_id++) {
+        uint8_t* centroids = (uint8_t*) (data + layout.centroids_offset[layer_id]);
+        for (size_t i = 0; i < orders[layer_id].size(); i++) {
+            codec.encode(layers[layer_id].kr.centroids.row(orders[layer_id][i]),
+                    centroids + i * code_size);
+        }
+        memcpy(data + layout.child_offsets_offset[layer_id], child_offsets[layer_id].data(),
+                child_offsets[layer_id].size() * sizeof(uint64_t));
+    }
+    const vector<size_t>& order = orders.back();
+
+    uint8_t* codes = (uint8_t*) (data + layout.codes_offset);
+    float* tree_vectors_original = (float*) (data + layout.vectors_original_offset);
+    int64_t* labels = (int64_t*) (data + layout.labels_offset);
+    for (size_t i = 0; i < order.size(); i++) {
+        codec.encode(vectors.row(order[i]), codes + i * code_size);
+        memcpy(tree_vectors_original + i * header.d, vectors_original + order[i] * header.d,
+                header.d * sizeof(float));
+        labels[i] = vector_labels ? vector_labels[order[i]] : order[i];
+    }
+
+    attach_tree(tree, data, layout.size);
+    return tree;
+}
+
+struct hkm_point_t {
+    idx_t label;
+    const float* original;
+
+    bool operator<(const hkm_point_t& other) const {
+        return label < other.label;
+    }
+};
 
-            best_centroids.push_back({result, c});
+// Scores rows [begin, end) into best_points.
+static void scan_leaf(const VectorCodec& codec, const VectorCodec::query_t& query,
+        const uint8_t* codes, const MatrixView<float>& vectors_original, const idx_t* labels,
+        size_t begin, size_t end, TopK<hkm_point_t>& best_points) {
+    size_t code_size = codec.code_size();
+    for (size_t c = begin; c < end; c++) {
+        float result = codec.inner_product(query, codes + c * code_size);
+        if (result >= best_points.threshold()) {
+            best_points.push(result, {labels[c], vectors_original.row(c)});
         }
+    }
+}
+
+// Calls f(chunk, rows) for every chunk of delta, oldest first, rows being
+// the number of its rows in delta.
+template <typename F>
+static void for_each_chunk(const leaf_delta_t& delta, F f) {
+    size_t remaining = delta.count;
+    for (const auto& chunk: delta.chunks) {
+        size_t rows = min(chunk->capacity, remaining);
+        f(*chunk, rows);
+        remaining -= rows;
+    }
+}
+
+static size_t leaf_size(const leaf_t& leaf) {
+    return leaf.end - leaf.begin + (leaf.delta ? leaf.delta->count : 0);
+}
 
-        if (best_centroids.size() > opened_trees) {
-            nth_element(
-                    best_centroids.begin(), 
-                    best_centroids.begin() + opened_trees,
-                    best_centroids.end(),
-                    greater<std::pair<float, size_t>>());
-            best_centroids.resize(opened_trees);
+// Scratch memory of one searching thread. Buffers only grow, so after a
+// few queries searching does not allocate.
+struct hkm_query_context_t {
+    VectorCodec::query_t query;
+    // Ranges of centroid ids to score on the current layer.
+    vector<pair<size_t, size_t>> candidates;
+    TopK<size_t> best_centroids;
+    TopK<hkm_point_t> best_points;
+};
+
+// Leaves best vectors found for the query in context.best_points, best first.
+static void predict(const tree_t& tree, const float* query,
+        const SearchParametersHKM& params, size_t k_needed, hkm_query_context_t& context) {
+
+    const VectorCodec& codec = tree.codec;
+    size_t code_size = codec.code_size();
+    codec.prepare_query(query, context.query);
+
+    vector<pair<size_t, size_t>>& candidates = context.candidates;
+    candidates.clear();
+    candidates.push_back({0, tree.layers.back().cluster_num});
+
+    TopK<size_t>& best_centroids = context.best_centroids;
+    for (size_t layer_id = tree.layers.size() - 1; layer_id != (size_t)(-1); layer_id--) {
+        const layer_t& layer = tree.layers[layer_id];
+        best_centroids.reset(params.opened_trees);
+        for (auto range: candidates) {
+            for (size_t c = range.first; c < range.second; c++) {
+                float result = codec.inner_product(
+                        context.query, layer.centroids + c * code_size);
+
+                best_centroids.push(result, c);
+            }
+        }
+
+        if (layer_id == 0) {
+            break;
         }
 
         candidates.clear();
 
-        for (auto val_cid: best_centroids) {
+        for (auto val_cid: best_centroids.entries) {
             size_t cid = val_cid.second;
-            candidates.insert(candidates.end(), 
-                    layers[layer_id].centroid_children[cid].begin(),
-                    layers[layer_id].centroid_children[cid].end()
-            );
+            candidates.push_back({layer.child_offsets[cid], layer.child_offsets[cid + 1]});
+        }
+    }
+
+    // Last layer - scan leaves starting from the most promising one, keeping
+    // k best points in a min-heap.
+    best_centroids.sort();
+    TopK<hkm_point_t>& best_points = context.best_points;
+    best_points.reset(k_needed);
+    size_t budget = params.candidate_budget ?
+            params.candidate_budget : numeric_limits<size_t>::max();
+    for (auto val_cid: best_centroids.entries) {
+        if (params.early_stop_margin >= 0 && best_points.full() &&
+                val_cid.first < best_points.threshold() - params.early_stop_margin) {
+            break;
+        }
+        const leaf_t& leaf = tree.leaves[val_cid.second];
+        size_t end = leaf.begin + min(leaf.end - leaf.begin, budget);
+        budget -= end - leaf.begin;
+        scan_leaf(codec, context.query, tree.codes, tree.vectors_original, tree.labels,
+                leaf.begin, end, best_points);
+
+        if (leaf.delta) {
+            for_each_chunk(*leaf.delta, [&](const delta_chunk_t& chunk, size_t rows) {
+                size_t count = min(rows, budget);
+                budget -= count;
+                scan_leaf(codec, context.query, chunk.codes.data(), chunk.vectors_original,
+                        chunk.labels.data(), 0, count, best_points);
+            });
+        }
+        if (budget == 0) {
+            break;
         }
     }
-    // Last layer - find best match.
-    vector<std::pair<float, size_t>> best_points;
-    for (auto c: candidates) {
-        float result = faiss::fvec_inner_product(
-                queries.row(qnum), 
-                vectors.row(c),
-                queries.vector_length);
+    best_points.sort();
+}
 
-        best_points.push_back({result, c});
+// Returns the leaf whose centroid is closest to vec, descending greedily.
+// centroid is a buffer for decoded centroids.
+static size_t route(const tree_t& tree, const float* vec, vector<float>& centroid) {
+    const VectorCodec& codec = tree.codec;
+    centroid.resize(codec.dim);
+    size_t begin = 0, end = tree.layers.back().cluster_num;
+    for (size_t layer_id = tree.layers.size() - 1; ; layer_id--) {
+        const layer_t& layer = tree.layers[layer_id];
+        size_t best = begin;
+        float best_dist = numeric_limits<float>::max();
+        for (size_t c = begin; c < end; c++) {
+            if (layer_id > 0 && layer.child_offsets[c] == layer.child_offsets[c + 1]) {
+                continue;
+            }
+            codec.decode(layer.centroids + c * codec.code_size(), centroid.data());
+            float dist = faiss::fvec_L2sqr(vec, centroid.data(), codec.dim);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = c;
+            }
+        }
+        if (layer_id == 0) {
+            return best;
+        }
+        begin = layer.child_offsets[best];
+        end = layer.child_offsets[best + 1];
     }
-    if (best_points.size() > k_needed) {
-        nth_element(
-                best_points.begin(), 
-                best_points.begin() + k_needed,
-                best_points.end(),
-                greater<std::pair<float, size_t>>());
-        best_points.resize(k_needed);
+}
+
+static const size_t min_chunk_capacity = 16;
+
+// Starts the delta of a leaf without appended vectors.
+static shared_ptr<leaf_delta_t> make_delta(const tree_t& tree, const leaf_t& leaf) {
+    const VectorCodec& codec = tree.codec;
+    shared_ptr<leaf_delta_t> delta = make_shared<leaf_delta_t>();
+    delta->sum.assign(codec.dim, 0);
+    vector<float> vec(codec.dim);
+    for (size_t i = leaf.begin; i < leaf.end; i++) {
+        codec.decode(tree.codes + i * codec.code_size(), vec.data());
+        faiss::fvec_madd(codec.dim, delta->sum.data(), 1, vec.data(), delta->sum.data());
     }
-    sort(best_points.rbegin(), best_points.rend());
+    return delta;
+}
+
+// Appends vectors to leaves of tree. Rows go to the free part of the last
+// chunk of a leaf, which no published tree reads, so only the leaf_delta_t
+// headers of the touched leaves are copied.
+static void append_vectors(tree_t& tree, const MatrixView<float>& vectors,
+        const MatrixView<float>& vectors_original, const idx_t* labels) {
+    vector<vector<size_t>> routed(tree.leaves.size());
+    vector<float> centroid;
+    for (size_t i = 0; i < vectors.vector_count(); i++) {
+        routed[route(tree, vectors.row(i), centroid)].push_back(i);
+    }
+    const VectorCodec& codec = tree.codec;
+    size_t code_size = codec.code_size();
+    size_t d = vectors_original.vector_length;
 
-    vector<size_t> res;
-    for (size_t i = 0; i < best_points.size(); i++) {
-        res.push_back(best_points[i].second);
+    for (size_t leaf_id = 0; leaf_id < routed.size(); leaf_id++) {
+        if (routed[leaf_id].empty()) {
+            continue;
+        }
+        leaf_t& leaf = tree.leaves[leaf_id];
+        shared_ptr<leaf_delta_t> delta = leaf.delta ?
+                make_shared<leaf_delta_t>(*leaf.delta) : make_delta(tree, leaf);
+        size_t filled = delta->count;
+        for (size_t j = 0; j + 1 < delta->chunks.size(); j++) {
+            filled -= delta->chunks[j]->capacity;
+        }
+        for (size_t j = 0; j < routed[leaf_id].size(); j++) {
+            if (delta->chunks.empty() || filled == delta->chunks.back()->capacity) {
+                size_t capacity = delta->chunks.empty() ?
+                        min_chunk_capacity : 2 * delta->chunks.back()->capacity;
+                capacity = max(capacity, routed[leaf_id].size() - j);
+                delta->chunks.push_back(make_shared<delta_chunk_t>(capacity, code_size, d));
+                filled = 0;
+            }
+            delta_chunk_t& chunk = *delta->chunks.back();
+            size_t i = routed[leaf_id][j];
+            tree.clamped = tree.clamped || !codec.in_range(vectors.row(i));
+            codec.encode(vectors.row(i), chunk.codes.data() + filled * code_size);
+            memcpy(chunk.vectors_original.row(filled), vectors_original.row(i), d * sizeof(float));
+            chunk.labels[filled] = labels[i];
+            faiss::fvec_madd(codec.dim, delta->sum.data(), 1, vectors.row(i), delta->sum.data());
+            filled++;
+            delta->count++;
+        }
+        leaf.delta = delta;
     }
-    return res;
+    tree.appended += vectors.vector_count();
+}
+
+// Retraining the codec re-encodes all vectors, so it waits until as many
+// vectors were appended as the flat arrays hold.
+static bool needs_retrain(const tree_t& tree) {
+    return tree.clamped && tree.appended >= tree.vectors_original.vector_count();
+}
+
+static size_t leaf_size_threshold(const tree_t& tree, size_t max_leaf_size) {
+    if (max_leaf_size != 0) {
+        return max_leaf_size;
+    }
+    size_t total = 0;
+    for (const auto& leaf: tree.leaves) {
+        total += leaf_size(leaf);
+    }
+    return max<size_t>(2, 2 * total / tree.leaves.size());
+}
+
+static bool needs_rebalance(const tree_t& tree, size_t threshold) {
+    for (const auto& leaf: tree.leaves) {
+        if (leaf.delta && leaf_size(leaf) > threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes centroids of all layers, with children of layers above the
+// leaves. Vectors of leaves are not listed.
+static vector<build_layer_t> decode_layers(const tree_t& tree) {
+    const VectorCodec& codec = tree.codec;
+    vector<build_layer_t> layers(tree.layers.size());
+    for (size_t layer_id = 0; layer_id < layers.size(); layer_id++) {
+        const layer_t& layer = tree.layers[layer_id];
+        build_layer_t& build_layer = layers[layer_id];
+        build_layer.cluster_num = layer.cluster_num;
+        build_layer.kr.centroids.resize(layer.cluster_num, codec.dim);
+        build_layer.centroid_children.resize(layer.cluster_num);
+        for (size_t c = 0; c < layer.cluster_num; c++) {
+            codec.decode(layer.centroids + c * codec.code_size(), build_layer.kr.centroids.row(c));
+            for (size_t i = 0; layer_id > 0 && i < layer.child_offsets[c + 1]
+                    - layer.child_offsets[c]; i++) {
+                build_layer.centroid_children[c].push_back(layer.child_offsets[c] + i);
+            }
+        }
+    }
+    return layers;
+}
+
+// Copies rows of a leaf into one chunk: its rows in the flat arrays if
+// base, then rows of its delta from skip on.
+static shared_ptr<delta_chunk_t> copy_rows(const tree_t& tree, const leaf_t& leaf,
+        bool base, size_t skip) {
+    size_t code_size = tree.codec.code_size();
+    size_t d = tree.vectors_original.vector_length;
+    size_t base_count = base ? leaf.end - leaf.begin : 0;
+    size_t count = base_count + (leaf.delta ? leaf.delta->count - skip : 0);
+    shared_ptr<delta_chunk_t> rows = make_shared<delta_chunk_t>(count, code_size, d);
+    size_t row = 0;
+    for (size_t i = 0; i < base_count; i++, row++) {
+        memcpy(rows->codes.data() + row * code_size,
+                tree.codes + (leaf.begin + i) * code_size, code_size);
+        memcpy(rows->vectors_original.row(row), tree.vectors_original.row(leaf.begin + i),
+                d * sizeof(float));
+        rows->labels[row] = tree.labels[leaf.begin + i];
+    }
+    if (!leaf.delta) {
+        return rows;
+    }
+    size_t first = 0;
+    for_each_chunk(*leaf.delta, [&](const delta_chunk_t& chunk, size_t chunk_rows) {
+        for (size_t i = max(first, skip) - first; i < chunk_rows; i++, row++) {
+            memcpy(rows->codes.data() + row * code_size,
+                    chunk.codes.data() + i * code_size, code_size);
+            memcpy(rows->vectors_original.row(row), chunk.vectors_original.row(i),
+                    d * sizeof(float));
+            rows->labels[row] = chunk.labels[i];
+        }
+        first += chunk_rows;
+    });
+    return rows;
+}
+
+// Makes a leaf of the given rows of a chunk, vectors being their decoded
+// codes.
+static leaf_t make_split_leaf(const delta_chunk_t& rows, const FloatMatrix& vectors,
+        const vector<size_t>& subset) {
+    size_t code_size = rows.codes.size() / rows.capacity;
+    size_t d = rows.vectors_original.vector_length;
+    shared_ptr<delta_chunk_t> chunk = make_shared<delta_chunk_t>(subset.size(), code_size, d);
+    shared_ptr<leaf_delta_t> delta = make_shared<leaf_delta_t>();
+    delta->sum.assign(vectors.vector_length, 0);
+    for (size_t j = 0; j < subset.size(); j++) {
+        size_t i = subset[j];
+        memcpy(chunk->codes.data() + j * code_size, rows.codes.data() + i * code_size, code_size);
+        memcpy(chunk->vectors_original.row(j), rows.vectors_original.row(i), d * sizeof(float));
+        chunk->labels[j] = rows.labels[i];
+        faiss::fvec_madd(vectors.vector_length, delta->sum.data(), 1, vectors.row(i),
+                delta->sum.data());
+    }
+    delta->chunks.push_back(chunk);
+    delta->count = subset.size();
+    leaf_t leaf;
+    leaf.begin = leaf.end = 0;
+    leaf.delta = delta;
+    return leaf;
+}
+
+static void set_mean(const FloatMatrix& points, const vector<size_t>& rows, float* out) {
+    size_t dim = points.vector_length;
+    memset(out, 0, dim * sizeof(float));
+    for (size_t i: rows) {
+        faiss::fvec_madd(dim, out, 1.0 / rows.size(), points.row(i), out);
+    }
+}
+
+struct layers_storage_t {
+    vector<vector<uint8_t>> centroids;
+    vector<vector<size_t>> child_offsets;
+};
+
+// Splits leaves with deltas larger than threshold in two with 2-means, the
+// new leaf goes under the same parent. Only vectors of split leaves are
+// copied, into new chunks; the flat arrays and other deltas are shared with
+// tree. Centroids of leaves with deltas become the means of their vectors
+// and centroids of their ancestors the means of their children, so that
+// routing follows the data. origin[i] is the leaf of tree that leaf i of
+// the result is, or -1 for halves of split leaves.
+static tree_t split_leaves(const hkm_build_t& build, const tree_t& tree,
+        size_t threshold, vector<size_t>& origin) {
+    size_t L = tree.layers.size();
+    const VectorCodec& codec = tree.codec;
+    size_t code_size = codec.code_size();
+    size_t dim = codec.dim;
+
+    vector<build_layer_t> layers = decode_layers(tree);
+    build_layer_t& bottom = layers[0];
+    vector<leaf_t> leaves = tree.leaves;
+    origin.resize(leaves.size());
+    // parents[l][c] - parent of centroid c of layer l in layer l + 1.
+    vector<vector<size_t>> parents(L);
+    for (size_t layer_id = 0; layer_id + 1 < L; layer_id++) {
+        parents[layer_id].resize(layers[layer_id].cluster_num);
+        const build_layer_t& above = layers[layer_id + 1];
+        for (size_t c = 0; c < above.cluster_num; c++) {
+            for (auto child: above.centroid_children[c]) {
+                parents[layer_id][child] = c;
+            }
+        }
+    }
+    vector<vector<bool>> changed(L);
+    for (size_t layer_id = 0; layer_id < L; layer_id++) {
+        changed[layer_id].assign(layers[layer_id].cluster_num, false);
+    }
+
+    for (size_t leaf_id = 0; leaf_id < tree.leaves.size(); leaf_id++) {
+        origin[leaf_id] = leaf_id;
+        const leaf_t& leaf = tree.leaves[leaf_id];
+        if (!leaf.delta) {
+            continue;
+        }
+        changed[0][leaf_id] = true;
+        if (leaf_size(leaf) <= threshold) {
+            continue;
+        }
+
+        shared_ptr<delta_chunk_t> rows = copy_rows(tree, leaf, true, 0);
+        FloatMatrix vectors;
+        vectors.resize(rows->capacity, dim);
+        for (size_t i = 0; i < rows->capacity; i++) {
+            codec.decode(rows->codes.data() + i * code_size, vectors.row(i));
+        }
+        kmeans_result kr = perform_kmeans(vectors, 2, build.kmeans_params);
+        vector<size_t> halves[2];
+        for (size_t i = 0; i < rows->capacity; i++) {
+            halves[kr.assignments[i]].push_back(i);
+        }
+        if (halves[0].empty() || halves[1].empty()) {
+            // Identical vectors, any split works.
+            halves[0].clear();
+            halves[1].clear();
+            for (size_t i = 0; i < rows->capacity; i++) {
+                halves[2 * i / rows->capacity].push_back(i);
+            }
+        }
+
+        size_t new_leaf = bottom.cluster_num++;
+        bottom.kr.centroids.resize(bottom.cluster_num, dim);
+        bottom.centroid_children.resize(bottom.cluster_num);
+        set_mean(vectors, halves[0], bottom.kr.centroids.row(leaf_id));
+        set_mean(vectors, halves[1], bottom.kr.centroids.row(new_leaf));
+        leaves[leaf_id] = make_split_leaf(*rows, vectors, halves[0]);
+        leaves.push_back(make_split_leaf(*rows, vectors, halves[1]));
+        origin[leaf_id] = size_t(-1);
+        origin.push_back(size_t(-1));
+        changed[0][leaf_id] = false;
+        changed[0].push_back(false);
+        if (L > 1) {
+            size_t p = parents[0][leaf_id];
+            parents[0].push_back(p);
+            layers[1].centroid_children[p].push_back(new_leaf);
+            changed[1][p] = true;
+        }
+    }
+
+    for (size_t leaf_id = 0; leaf_id < leaves.size(); leaf_id++) {
+        if (!changed[0][leaf_id]) {
+            continue;
+        }
+        float* centroid = bottom.kr.centroids.row(leaf_id);
+        memset(centroid, 0, dim * sizeof(float));
+        faiss::fvec_madd(dim, centroid, 1.0 / leaf_size(leaves[leaf_id]),
+                leaves[leaf_id].delta->sum.data(), centroid);
+        if (L > 1) {
+            changed[1][parents[0][leaf_id]] = true;
+        }
+    }
+    for (size_t layer_id = 1; layer_id < L; layer_id++) {
+        build_layer_t& layer = layers[layer_id];
+        for (size_t c = 0; c < layer.cluster_num; c++) {
+            if (!changed[layer_id][c] || layer.centroid_children[c].empty()) {
+                continue;
+            }
+            set_mean(layers[layer_id - 1].kr.centroids, layer.centroid_children[c],
+                    layer.kr.centroids.row(c));
+            if (layer_id + 1 < L) {
+                changed[layer_id + 1][parents[layer_id][c]] = true;
+            }
+        }
+    }
+
+    vector<vector<size_t>> child_offsets;
+    vector<vector<size_t>> orders = order_layers(layers, child_offsets);
+    shared_ptr<layers_storage_t> storage = make_shared<layers_storage_t>();
+    storage->centroids.resize(L);
+    storage->child_offsets.swap(child_offsets);
+    tree_t result = tree;
+    for (size_t layer_id = 0; layer_id < L; layer_id++) {
+        const vector<size_t>& order = orders[layer_id];
+        vector<uint8_t>& centroids = storage->centroids[layer_id];
+        centroids.resize(order.size() * code_size);
+        for (size_t i = 0; i < order.size(); i++) {
+            codec.encode(layers[layer_id].kr.centroids.row(order[i]), centroids.data() + i * code_size);
+        }
+        layer_t& layer = result.layers[layer_id];
+        layer.centroids = centroids.data();
+        layer.child_offsets = layer_id > 0 ? storage->child_offsets[layer_id].data() : nullptr;
+        layer.cluster_num = order.size();
+    }
+    result.leaves.clear();
+    vector<size_t> leaf_origin;
+    for (size_t leaf_id: orders[0]) {
+        result.leaves.push_back(leaves[leaf_id]);
+        leaf_origin.push_back(origin[leaf_id]);
+    }
+    origin.swap(leaf_origin);
+    result.layers_storage = storage;
+    return result;
+}
+
+// Builds new flat arrays with all vectors of the leaves, deltas included.
+// If retrain, the codec is trained again on vectors augmented anew from the
+// original ones, so that values it clamped before are encoded in range.
+static tree_t merge_tree(const hkm_build_t& build, const tree_t& tree,
+        bool retrain) {
+    const VectorCodec& codec = tree.codec;
+    size_t code_size = codec.code_size();
+    size_t d = tree.vectors_original.vector_length;
+
+    vector<build_layer_t> layers = decode_layers(tree);
+    size_t total = 0;
+    for (const auto& leaf: tree.leaves) {
+        total += leaf_size(leaf);
+    }
+    FloatMatrix vectors, vectors_original;
+    vectors.resize(total, codec.dim);
+    vectors_original.resize(total, d);
+    vector<idx_t> labels(total);
+
+    size_t row = 0;
+    for (size_t leaf_id = 0; leaf_id < tree.leaves.size(); leaf_id++) {
+        const leaf_t& leaf = tree.leaves[leaf_id];
+        vector<size_t>& children = layers[0].centroid_children[leaf_id];
+        for (size_t i = leaf.begin; i < leaf.end; i++, row++) {
+            codec.decode(tree.codes + i * code_size, vectors.row(row));
+            memcpy(vectors_original.row(row), tree.vectors_original.row(i), d * sizeof(float));
+            labels[row] = tree.labels[i];
+            children.push_back(row);
+        }
+        if (!leaf.delta) {
+            continue;
+        }
+        for_each_chunk(*leaf.delta, [&](const delta_chunk_t& chunk, size_t rows) {
+            for (size_t i = 0; i < rows; i++, row++) {
+                codec.decode(chunk.codes.data() + i * code_size, vectors.row(row));
+                memcpy(vectors_original.row(row), chunk.vectors_original.row(i),
+                        d * sizeof(float));
+                labels[row] = chunk.labels[i];
+                children.push_back(row);
+            }
+        });
+    }
+
+    if (!retrain) {
+        return make_tree(build, codec, layers, vectors, vectors_original.data.data(),
+                labels.data());
+    }
+    build.augmentation->extend_into(vectors_original.data.data(), total, vectors.data.data());
+    VectorCodec retrained(codec.type, codec.dim);
+    retrained.train(vectors);
+    return make_tree(build, retrained, layers, vectors, vectors_original.data.data(),
+            labels.data());
+}
+
+SearchParametersHKM::SearchParametersHKM(
+        size_t opened_trees, size_t candidate_budget, float early_stop_margin):
+    opened_trees(opened_trees), candidate_budget(candidate_budget),
+    early_stop_margin(early_stop_margin)
+{
+}
+
+IndexHierarchicKmeans::delta_chunk_t::delta_chunk_t(
+        size_t capacity, size_t code_size, size_t d):
+    codes(capacity * code_size), labels(capacity), capacity(capacity)
+{
+    vectors_original.resize(capacity, d);
+}
+
+IndexHierarchicKmeans::leaf_delta_t::leaf_delta_t(): count(0)
+{
+}
+
+IndexHierarchicKmeans::tree_t::tree_t():
+    codes(nullptr), labels(nullptr), storage_data(nullptr), storage_size(0),
+    appended(0), clamped(false)
+{
 }
 
 IndexHierarchicKmeans::IndexHierarchicKmeans(
         size_t dim, size_t layers_count, size_t opened_trees, MipsAugmentation* aug):
     Index(dim, faiss::METRIC_INNER_PRODUCT),
-    layers_count(layers_count), opened_trees(opened_trees), augmentation(aug)
+    layers_count(layers_count), opened_trees(opened_trees), max_leaf_size(0),
+    storage_type(CODEC_FP32), augmentation(aug), own_augmentation(false), rebalancing(false)
 {
 }
 
+IndexHierarchicKmeans::~IndexHierarchicKmeans() {
+    if (rebalance_thread.joinable()) {
+        rebalance_thread.join();
+    }
+    if (own_augmentation) {
+        delete augmentation;
+    }
+}
+
+void IndexHierarchicKmeans::train(idx_t n, const float* data) {
+    lock_guard<mutex> lock(update_mutex);
+    augmentation->train(data, n);
+}
+
 void IndexHierarchicKmeans::add(idx_t n, const float* data) {
-    vectors_original.resize(n, d);
-    memcpy(vectors_original.data.data(), data, n * d * sizeof(float));
-    vectors = augmentation->extend(data, n);
-    layers = make_layers(vectors, layers_count);
+    if (n == 0) {
+        return;
+    }
+    lock_guard<mutex> lock(update_mutex);
+    // Unless the augmentation was trained, the first batch fixes the scaling
+    // of all later ones.
+    FloatMatrix vectors = augmentation->extend(data, n);
+    shared_ptr<const tree_t> current = atomic_load(&tree);
+    if (!current) {
+        vector<build_layer_t> layers = make_layers(vectors, layers_count, kmeans_params);
+        VectorCodec codec(storage_type, vectors.vector_length);
+        codec.train(vectors);
+        atomic_store(&tree, shared_ptr<const tree_t>(
+                make_shared<tree_t>(make_tree(build_params(*this), codec, layers, vectors, data))));
+        ntotal = n;
+        return;
+    }
+
+    vector<idx_t> labels(n);
+    for (idx_t i = 0; i < n; i++) {
+        labels[i] = ntotal + i;
+    }
+    shared_ptr<tree_t> updated = make_shared<tree_t>(*current);
+    append_vectors(*updated, vectors, MatrixView<float>(data, n, d, d), labels.data());
+    atomic_store(&tree, shared_ptr<const tree_t>(updated));
+    ntotal += n;
+
+    if (!rebalancing && (needs_retrain(*updated) ||
+            needs_rebalance(*updated, leaf_size_threshold(*updated, max_leaf_size)))) {
+        // The previous thread, if any, has already finished its work.
+        if (rebalance_thread.joinable()) {
+            rebalance_thread.join();
+        }
+        rebalancing = true;
+        rebalance_thread = thread(&IndexHierarchicKmeans::rebalance, this);
+    }
+}
+
+void IndexHierarchicKmeans::rebalance() {
+    for (;;) {
+        shared_ptr<const tree_t> snapshot;
+        size_t threshold;
+        bool retrain;
+        hkm_build_t build;
+        {
+            lock_guard<mutex> lock(update_mutex);
+            snapshot = atomic_load(&tree);
+            build = build_params(*this);
+            threshold = leaf_size_threshold(*snapshot, max_leaf_size);
+            retrain = needs_retrain(*snapshot);
+            if (!retrain && !needs_rebalance(*snapshot, threshold)) {
+                rebalancing = false;
+                return;
+            }
+        }
+
+        // origin[i] - leaf of snapshot that leaf i of rebuilt is unchanged,
+        // -1 for leaves built anew.
+        vector<size_t> origin;
+        shared_ptr<tree_t> rebuilt;
+        if (retrain) {
+            rebuilt = make_shared<tree_t>(merge_tree(build, *snapshot, true));
+            origin.assign(rebuilt->leaves.size(), size_t(-1));
+        } else {
+            rebuilt = make_shared<tree_t>(split_leaves(build, *snapshot, threshold, origin));
+        }
+
+        lock_guard<mutex> lock(update_mutex);
+        // Unchanged leaves take their current deltas, which may have grown
+        // meanwhile. Vectors added meanwhile to the other leaves are the
+        // suffixes of their current deltas beyond the snapshot ones and are
+        // routed again.
+        shared_ptr<const tree_t> current = atomic_load(&tree);
+        vector<bool> rebuilt_leaf(snapshot->leaves.size(), true);
+        for (size_t leaf = 0; leaf < rebuilt->leaves.size(); leaf++) {
+            if (origin[leaf] != size_t(-1)) {
+                rebuilt->leaves[leaf].delta = current->leaves[origin[leaf]].delta;
+                rebuilt_leaf[origin[leaf]] = false;
+            }
+        }
+        for (size_t leaf = 0; leaf < snapshot->leaves.size(); leaf++) {
+            const leaf_t& before = snapshot->leaves[leaf];
+            const leaf_t& after = current->leaves[leaf];
+            size_t skip = before.delta ? before.delta->count : 0;
+            if (!rebuilt_leaf[leaf] || !after.delta || after.delta->count == skip) {
+                continue;
+            }
+            shared_ptr<delta_chunk_t> rows = copy_rows(*current, after, false, skip);
+            FloatMatrix vectors;
+            vectors.resize(rows->capacity, augmentation->dim + augmentation->m);
+            augmentation->extend_into(rows->vectors_original.data.data(), rows->capacity,
+                    vectors.data.data());
+            append_vectors(*rebuilt, vectors, rows->vectors_original, rows->labels.data());
+        }
+        if (!retrain) {
+            rebuilt->appended = current->appended;
+            rebuilt->clamped = current->clamped;
+        }
+        atomic_store(&tree, shared_ptr<const tree_t>(rebuilt));
+    }
 }
 
 void IndexHierarchicKmeans::reset() {
-    vectors.data.clear();
-    vectors_original.data.clear();
-    layers.clear();
+    if (rebalance_thread.joinable()) {
+        rebalance_thread.join();
+    }
+    lock_guard<mutex> lock(update_mutex);
+    atomic_store(&tree, shared_ptr<const tree_t>());
+    ntotal = 0;
 }
 
-void IndexHierarchicKmeans::search(idx_t n, const float* data, idx_t k, 
+void IndexHierarchicKmeans::search(idx_t n, const float* data, idx_t k,
         float* distances, idx_t* labels) const {
-    FloatMatrix queries_original;
-    queries_original.resize(n, d);
-    memcpy(queries_original.data.data(), data, n * d * sizeof(float));
+    search(n, data, k, distances, labels, SearchParametersHKM(opened_trees));
+}
+
+void IndexHierarchicKmeans::search(idx_t n, const float* data, idx_t k,
+        float* distances, idx_t* labels, const SearchParametersHKM& params) const {
+    shared_ptr<const tree_t> current = atomic_load(&tree);
+    if (!current) {
+        // Nothing was added since construction or reset().
+        fill(labels, labels + n * k, -1);
+        fill(distances, distances + n * k, -HUGE_VALF);
+        return;
+    }
+
     FloatMatrix queries = augmentation->extend_queries(data, n);
 
-    FlatMatrix<idx_t> labels_matrix;
-    labels_matrix.resize(n, k);
     #pragma omp parallel for
     for (size_t i = 0; i < queries.vector_count(); i++) {
-        vector<size_t> predictions = predict(layers, queries, i, opened_trees, vectors, k);
-        for (idx_t j = 0; j < k; j++) {
-            labels_matrix.at(i, j) = (size_t(j) < predictions.size()) ? predictions[j] : -1;
-        }
+        static thread_local hkm_query_context_t context;
+        predict(*current, queries.row(i), params, k, context);
 
+        const vector<TopK<hkm_point_t>::entry_t>& predictions = context.best_points.entries;
         for (idx_t j = 0; j < k; j++) {
-            idx_t lab = labels_matrix.at(i, j);
-            if (lab != -1) {
+            if (size_t(j) < predictions.size()) {
+                labels[i * k + j] = predictions[j].second.label;
                 distances[i * k + j] = faiss::fvec_inner_product(
-                    vectors_original.row(lab),
-                    queries_original.row(i),
+                    predictions[j].second.original,
+                    data + i * d,
                     d
                 );
+            } else {
+                labels[i * k + j] = -1;
             }
         }
     }
-    memcpy(labels, labels_matrix.data.data(), n * k * sizeof(idx_t));
+}
+
+void write_index_hkm(const IndexHierarchicKmeans* index, const string& filename) {
+    shared_ptr<const tree_t> current = atomic_load(&index->tree);
+    if (!current) {
+        throw runtime_error("Cannot write an empty index");
+    }
+    bool merged = !current->layers_storage;
+    for (const auto& leaf: current->leaves) {
+        merged = merged && !leaf.delta;
+    }
+    if (!merged) {
+        // Merge appended vectors into the flat arrays first.
+        current = make_shared<tree_t>(merge_tree(build_params(*index), *current, false));
+    }
+    const tree_t& tree = *current;
+    // Search parameters could have changed since the tree was built.
+    hkm_header_t header = read_header(tree.storage_data, tree.storage_size);
+    header.opened_trees = index->opened_trees;
+
+    ofstream outfile(filename, ios::binary);
+    outfile.write((const char*) &header, sizeof(header));
+    outfile.write(tree.storage_data + sizeof(header), tree.storage_size - sizeof(header));
+    if (outfile.fail()) {
+        throw runtime_error("Failed to write index file " + filename);
+    }
+}
+
+IndexHierarchicKmeans* read_index_hkm(const string& filename) {
+    shared_ptr<MappedFile> file = make_shared<MappedFile>(filename);
+
+    tree_t tree;
+    tree.storage = file;
+    attach_tree(tree, file->data, file->size);
+
+    hkm_header_t header = read_header(file->data, file->size);
+    MipsAugmentation* aug = make_augmentation(header);
+    if (aug->m + header.d != header.vector_length) {
+        delete aug;
+        throw runtime_error("Inconsistent vector length in index file");
+    }
+
+    IndexHierarchicKmeans* index = new IndexHierarchicKmeans(
+            header.d, header.layers_count, header.opened_trees, aug);
+    index->own_augmentation = true;
+    index->tree = make_shared<tree_t>(tree);
+    index->ntotal = header.ntotal;
+    return index;
 }
@@ -1,27 +1,151 @@
 #include "common.h"
+#include "precision.h"
 
 #include "../faiss/Index.h"
 
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Per-call search parameters, so that queries with different latency
+// budgets can share one index.
+struct SearchParametersHKM {
+    explicit SearchParametersHKM(size_t opened_trees = 1,
+            size_t candidate_budget = 0, float early_stop_margin = -1);
+
+    // Number of best centroids expanded on every layer.
+    size_t opened_trees;
+    // Maximum number of vectors scored per query, 0 means unlimited.
+    size_t candidate_budget;
+    // Leaf clusters are scanned from the best centroid down. Scanning stops
+    // once the next centroid scores below the current k-th result by more
+    // than this margin. Negative value disables early stopping.
+    float early_stop_margin;
+};
+
 struct IndexHierarchicKmeans: public faiss::Index {
+    // Centroids of every layer are ordered by their parent, so children of
+    // centroid c are the range [child_offsets[c], child_offsets[c + 1]) of the
+    // layer below. Vectors of leaves are given by tree_t::leaves instead.
     struct layer_t {
-        kmeans_result kr;
-        std::vector<std::vector<size_t>> centroid_children;
+        // Centroid codes, code_size() bytes each.
+        const uint8_t* centroids;
+        // nullptr for layer 0 of trees with rebuilt layers.
+        const size_t* child_offsets;
         size_t cluster_num;
     };
 
+    // Append-only rows of vectors added to a leaf after the flat arrays were
+    // built. A row is written before any tree that counts it is published
+    // and never changes after, so trees share chunks without copying them.
+    struct delta_chunk_t {
+        delta_chunk_t(size_t capacity, size_t code_size, size_t d);
+
+        std::vector<uint8_t> codes;
+        FloatMatrix vectors_original;
+        std::vector<idx_t> labels;
+        size_t capacity;
+    };
+
+    // Vectors appended to a leaf: the first count rows of chunks, all chunks
+    // but the last one being full. Capacities double, so appending takes
+    // amortized constant time.
+    struct leaf_delta_t {
+        leaf_delta_t();
+
+        std::vector<std::shared_ptr<delta_chunk_t>> chunks;
+        size_t count;
+        // Sum of all augmented vectors of the leaf, including its rows in
+        // the flat arrays, so that its centroid is updated without a scan.
+        std::vector<float> sum;
+    };
+
+    // Rows [begin, end) of the flat arrays and appended vectors. Leaves
+    // split after the flat arrays were built keep all vectors in delta.
+    struct leaf_t {
+        size_t begin, end;
+        std::shared_ptr<const leaf_delta_t> delta;
+    };
+
+    // Whole tree in flat arrays. Views point into storage, which is either
+    // a buffer filled by add() or a memory-mapped index file. A published
+    // tree is never modified, updates build a new one.
+    struct tree_t {
+        tree_t();
+
+        // Encodes augmented vectors and centroids.
+        VectorCodec codec;
+        std::vector<layer_t> layers;
+        // Augmented vectors in cluster order, encoded with codec.
+        const uint8_t* codes;
+        // Original vectors in cluster order.
+        MatrixView<float> vectors_original;
+        // Id of each vector in cluster order.
+        const idx_t* labels;
+
+        std::shared_ptr<const void> storage;
+        const char* storage_data;
+        size_t storage_size;
+        // Owns layers rebuilt after leaves were split, nullptr while layers
+        // point into storage.
+        std::shared_ptr<const void> layers_storage;
+
+        // Vectors of every leaf of layer 0.
+        std::vector<leaf_t> leaves;
+        // Vectors added since the flat arrays were built, and whether codec
+        // clamped some of them.
+        size_t appended;
+        bool clamped;
+    };
+
     IndexHierarchicKmeans(size_t dim, size_t layers_count, size_t opened_trees, MipsAugmentation* aug);
+    ~IndexHierarchicKmeans();
+    // The first call clusters the data. Later calls route vectors to the
+    // closest leaves and, if some leaf grows beyond max_leaf_size, split it
+    // in a background thread. Once vectors out of the CODEC_INT8 ranges
+    // were added and as many vectors were added as the flat arrays hold,
+    // the tree is rebuilt with retrained ranges instead. Searches are never
+    // blocked.
     void add(idx_t n, const float* data);
+    // Searches with default parameters built from opened_trees.
     void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels) const;
+    void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels,
+            const SearchParametersHKM& params) const;
     void reset();
-    // void train(idx_t n, const float* data);
+    // Fixes the scaling of the augmentation, otherwise the first add() does.
+    void train(idx_t n, const float* data);
     
 
-    FloatMatrix vectors;
-    FloatMatrix vectors_original;
-    std::vector<layer_t> layers;
+    // Current tree, accessed with std::atomic_load/atomic_store.
+    std::shared_ptr<const tree_t> tree;
 
     // Parameters:
     size_t layers_count;
     size_t opened_trees;
+    // Leaves with appended vectors are split when they grow larger than this.
+    // 0 means twice the mean leaf size.
+    size_t max_leaf_size;
+    // Precision in which add() stores augmented vectors and centroids.
+    // Original vectors are kept in fp32 for exact distances.
+    VectorCodecType storage_type;
     MipsAugmentation* augmentation;
+    // Whether augmentation is deleted with the index.
+    bool own_augmentation;
+    // Clustering of the layers and of split leaves.
+    KmeansParams kmeans_params;
+
+private:
+    void rebalance();
+
+    // Serialises add() and publishing of rebalanced trees.
+    std::mutex update_mutex;
+    std::thread rebalance_thread;
+    bool rebalancing;
 };
+
+// Saves the index in a single versioned file.
+void write_index_hkm(const IndexHierarchicKmeans* index, const std::string& filename);
+
+// Maps an index file into memory. The tree is used in place, without copying.
+// Throws std::runtime_error on malformed files.
+IndexHierarchicKmeans* read_index_hkm(const std::string& filename);
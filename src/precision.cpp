@@ -0,0 +1,372 @@
+#include "precision.h"
+
+#include "../faiss/utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <immintrin.h>
+
+using namespace std;
+
+
+uint16_t float_to_fp16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int32_t exp = int32_t((x >> 23) & 0xff) - 127 + 15;
+
+    if (((x >> 23) & 0xff) == 0xff) {
+        // Infinity or NaN.
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    if (exp >= 31) {
+        return sign | 0x7c00;
+    }
+    if (exp <= 0) {
+        // Subnormal half or zero.
+        if (exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = sign | (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    // Round to nearest even, carry into the exponent is correct.
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return half;
+}
+
+float fp16_to_float(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else {
+            // Normalize the subnormal.
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if (exp == 31) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_bf16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        // Keep NaN a NaN.
+        return (x >> 16) | 0x40;
+    }
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+float bf16_to_float(uint16_t h) {
+    uint32_t x = uint32_t(h) << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Scalar kernels, also used for tails of the SIMD ones.
+
+static float fp16_inner_product_ref(const float* x, const uint16_t* y, size_t d) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        sum += x[i] * fp16_to_float(y[i]);
+    }
+    return sum;
+}
+
+static float bf16_inner_product_ref(const float* x, const uint16_t* y, size_t d) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        sum += x[i] * bf16_to_float(y[i]);
+    }
+    return sum;
+}
+
+static int32_t u8s8_inner_product_ref(const uint8_t* x, const int8_t* y, size_t d) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        sum += int32_t(x[i]) * int32_t(y[i]);
+    }
+    return sum;
+}
+
+// AVX2 kernels.
+
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx2(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static float fp16_inner_product_avx2(const float* x, const uint16_t* y, size_t d) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m256 yf = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (y + i)));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), yf, acc);
+    }
+    return hsum_avx2(acc) + fp16_inner_product_ref(x + i, y + i, d - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float bf16_inner_product_avx2(const float* x, const uint16_t* y, size_t d) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m256i yi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (y + i)));
+        __m256 yf = _mm256_castsi256_ps(_mm256_slli_epi32(yi, 16));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), yf, acc);
+    }
+    return hsum_avx2(acc) + bf16_inner_product_ref(x + i, y + i, d - i);
+}
+
+__attribute__((target("avx2")))
+static int32_t u8s8_inner_product_avx2(const uint8_t* x, const int8_t* y, size_t d) {
+    // Bytes are widened to 16 bits, as maddubs would saturate 255 * 127 * 2.
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m256i xi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (x + i)));
+        __m256i yi = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*) (y + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xi, yi));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum) + u8s8_inner_product_ref(x + i, y + i, d - i);
+}
+
+// AVX-512 kernels.
+
+// GCC 12 warns about _mm512_undefined_* used inside its own intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static float fp16_inner_product_avx512(const float* x, const uint16_t* y, size_t d) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m512 yf = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*) (y + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), yf, acc);
+    }
+    return _mm512_reduce_add_ps(acc) + fp16_inner_product_ref(x + i, y + i, d - i);
+}
+
+__attribute__((target("avx512f")))
+static float bf16_inner_product_avx512(const float* x, const uint16_t* y, size_t d) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m512i yi = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) (y + i)));
+        __m512 yf = _mm512_castsi512_ps(_mm512_slli_epi32(yi, 16));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), yf, acc);
+    }
+    return _mm512_reduce_add_ps(acc) + bf16_inner_product_ref(x + i, y + i, d - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t u8s8_inner_product_vnni(const uint8_t* x, const int8_t* y, size_t d) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= d; i += 64) {
+        acc = _mm512_dpbusd_epi32(acc,
+                _mm512_loadu_si512((const void*) (x + i)),
+                _mm512_loadu_si512((const void*) (y + i)));
+    }
+    return _mm512_reduce_add_epi32(acc) + u8s8_inner_product_ref(x + i, y + i, d - i);
+}
+
+#pragma GCC diagnostic pop
+
+// Runtime dispatch.
+
+float fp16_inner_product(const float* x, const uint16_t* y, size_t d) {
+    switch (simd_level()) {
+    case SIMD_AVX512_VNNI:
+    case SIMD_AVX512: return fp16_inner_product_avx512(x, y, d);
+    case SIMD_AVX2: return fp16_inner_product_avx2(x, y, d);
+    default: return fp16_inner_product_ref(x, y, d);
+    }
+}
+
+float bf16_inner_product(const float* x, const uint16_t* y, size_t d) {
+    switch (simd_level()) {
+    case SIMD_AVX512_VNNI:
+    case SIMD_AVX512: return bf16_inner_product_avx512(x, y, d);
+    case SIMD_AVX2: return bf16_inner_product_avx2(x, y, d);
+    default: return bf16_inner_product_ref(x, y, d);
+    }
+}
+
+int32_t u8s8_inner_product(const uint8_t* x, const int8_t* y, size_t d) {
+    switch (simd_level()) {
+    case SIMD_AVX512_VNNI: return u8s8_inner_product_vnni(x, y, d);
+    case SIMD_AVX512:
+    case SIMD_AVX2: return u8s8_inner_product_avx2(x, y, d);
+    default: return u8s8_inner_product_ref(x, y, d);
+    }
+}
+
+VectorCodec::VectorCodec(VectorCodecType type, size_t dim):
+    type(type), dim(dim) {}
+
+size_t VectorCodec::code_size() const {
+    switch (type) {
+    case CODEC_FP16:
+    case CODEC_BF16: return dim * sizeof(uint16_t);
+    case CODEC_INT8: return dim;
+    default: return dim * sizeof(float);
+    }
+}
+
+void VectorCodec::train(const MatrixView<float>& x) {
+    if (type != CODEC_INT8) {
+        return;
+    }
+    vmin.assign(dim, HUGE_VALF);
+    vector<float> vmax(dim, -HUGE_VALF);
+    for (size_t i = 0; i < x.vector_count(); i++) {
+        const float* row = x.row(i);
+        for (size_t j = 0; j < dim; j++) {
+            vmin[j] = min(vmin[j], row[j]);
+            vmax[j] = max(vmax[j], row[j]);
+        }
+    }
+    vdiff.resize(dim);
+    for (size_t j = 0; j < dim; j++) {
+        if (vmin[j] > vmax[j]) {
+            vmin[j] = vmax[j] = 0;
+        }
+        vdiff[j] = vmax[j] - vmin[j];
+    }
+}
+
+void VectorCodec::encode(const float* x, uint8_t* code) const {
+    switch (type) {
+    case CODEC_FP16:
+        for (size_t i = 0; i < dim; i++) {
+            uint16_t h = float_to_fp16(x[i]);
+            memcpy(code + i * sizeof(h), &h, sizeof(h));
+        }
+        break;
+    case CODEC_BF16:
+        for (size_t i = 0; i < dim; i++) {
+            uint16_t h = float_to_bf16(x[i]);
+            memcpy(code + i * sizeof(h), &h, sizeof(h));
+        }
+        break;
+    case CODEC_INT8:
+        for (size_t i = 0; i < dim; i++) {
+            float v = vdiff[i] > 0 ? (x[i] - vmin[i]) / vdiff[i] * 255 : 0;
+            code[i] = (uint8_t) max(0.0f, min(255.0f, roundf(v)));
+        }
+        break;
+    default:
+        memcpy(code, x, dim * sizeof(float));
+    }
+}
+
+bool VectorCodec::in_range(const float* x) const {
+    if (type != CODEC_INT8) {
+        return true;
+    }
+    for (size_t i = 0; i < dim; i++) {
+        if (x[i] < vmin[i] || x[i] > vmin[i] + vdiff[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void VectorCodec::decode(const uint8_t* code, float* x) const {
+    switch (type) {
+    case CODEC_FP16:
+        for (size_t i = 0; i < dim; i++) {
+            uint16_t h;
+            memcpy(&h, code + i * sizeof(h), sizeof(h));
+            x[i] = fp16_to_float(h);
+        }
+        break;
+    case CODEC_BF16:
+        for (size_t i = 0; i < dim; i++) {
+            uint16_t h;
+            memcpy(&h, code + i * sizeof(h), sizeof(h));
+            x[i] = bf16_to_float(h);
+        }
+        break;
+    case CODEC_INT8:
+        for (size_t i = 0; i < dim; i++) {
+            x[i] = vmin[i] + code[i] * vdiff[i] / 255;
+        }
+        break;
+    default:
+        memcpy(x, code, dim * sizeof(float));
+    }
+}
+
+void VectorCodec::prepare_query(const float* query, query_t& prepared) const {
+    prepared.data = query;
+    if (type != CODEC_INT8) {
+        return;
+    }
+    // <query, x> ~ sum query[i] * vmin[i] + sum (query[i] * vdiff[i] / 255) * code[i],
+    // the scaled query in the second sum is quantized to int8.
+    prepared.offset = 0;
+    float absmax = 0;
+    for (size_t i = 0; i < dim; i++) {
+        prepared.offset += query[i] * vmin[i];
+        absmax = max(absmax, fabsf(query[i] * vdiff[i] / 255));
+    }
+    prepared.scale = absmax > 0 ? absmax / 127 : 1;
+    prepared.quantized.resize(dim);
+    for (size_t i = 0; i < dim; i++) {
+        prepared.quantized[i] = (int8_t) roundf(query[i] * vdiff[i] / 255 / prepared.scale);
+    }
+}
+
+float VectorCodec::inner_product(const query_t& query, const uint8_t* code) const {
+    switch (type) {
+    case CODEC_FP16:
+        return fp16_inner_product(query.data, (const uint16_t*) code, dim);
+    case CODEC_BF16:
+        return bf16_inner_product(query.data, (const uint16_t*) code, dim);
+    case CODEC_INT8:
+        return query.offset + query.scale
+            * u8s8_inner_product(code, query.quantized.data(), dim);
+    default:
+        return faiss::fvec_inner_product(query.data, (const float*) code, dim);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef PRECISION_H_
+#define PRECISION_H_
+
+#include "common.h"
+
+#include <cstdint>
+
+
+enum VectorCodecType {
+    CODEC_FP32 = 0,
+    CODEC_FP16 = 1,
+    CODEC_BF16 = 2,
+    // Scalar quantization to uint8 with per-dimension range. Queries are
+    // quantized to int8 as well, so scores are approximate.
+    CODEC_INT8 = 3,
+};
+
+// Stores float vectors in reduced precision and scores float queries
+// against the codes. Kernels are picked at runtime from the instruction
+// sets the CPU supports (AVX2/F16C, AVX-512, AVX-512 VNNI).
+struct VectorCodec {
+    // Query converted to the form expected by inner_product().
+    struct query_t {
+        const float* data;
+        // CODEC_INT8: query scaled by vdiff and quantized to int8, so that
+        // product = offset + scale * <quantized, code>.
+        std::vector<int8_t> quantized;
+        float scale;
+        float offset;
+    };
+
+    VectorCodec(VectorCodecType type = CODEC_FP32, size_t dim = 0);
+
+    size_t code_size() const;
+    // Learns value ranges for CODEC_INT8, does nothing for other types.
+    void train(const MatrixView<float>& x);
+    // CODEC_INT8 clamps values out of the trained ranges.
+    void encode(const float* x, uint8_t* code) const;
+    // Whether encode() keeps x within the trained ranges.
+    bool in_range(const float* x) const;
+    void decode(const uint8_t* code, float* x) const;
+    // query_t buffers are reused, so preparing queries does not allocate
+    // in steady state. query must outlive prepared.
+    void prepare_query(const float* query, query_t& prepared) const;
+    float inner_product(const query_t& query, const uint8_t* code) const;
+
+    VectorCodecType type;
+    size_t dim;
+    // CODEC_INT8: x[i] ~ vmin[i] + code[i] * vdiff[i] / 255.
+    std::vector<float> vmin;
+    std::vector<float> vdiff;
+};
+
+uint16_t float_to_fp16(float f);
+float fp16_to_float(uint16_t h);
+uint16_t float_to_bf16(float f);
+float bf16_to_float(uint16_t h);
+
+float fp16_inner_product(const float* x, const uint16_t* y, size_t d);
+float bf16_inner_product(const float* x, const uint16_t* y, size_t d);
+// Exact integer inner product of unsigned and signed bytes.
+int32_t u8s8_inner_product(const uint8_t* x, const int8_t* y, size_t d);
+
+#endif
@@ -1,9 +1,12 @@
 #include "quantization.h"
 
 #include "common.h"
+#include "fastscan.h"
+#include "topk.h"
 
 #include "../faiss/utils.h"
 #include "../faiss/Clustering.h"
+#include "../faiss/IndexFlat.h"
 
 #include <iostream>
 #include <vector>
@@ -11,18 +14,20 @@
 #include <string>
 #include <algorithm> 
 #include <numeric>  
+#include <stdexcept>
+#include <functional>
+#include <cmath>
+
+#include <omp.h>
 
 using namespace std;
 
-static vector<size_t> prepare_permutation(size_t m) {
-    // TODO: Don't shuffle, but rotate randomly.
-    // TODO: Also, probably use some better source of randomness.
-    vector<size_t> permutation;
-    for (size_t i = 0; i < m; i++) {
-        permutation.push_back(i);
-    }
-    random_shuffle(permutation.begin(), permutation.end());
-    return permutation;
+extern "C" {
+
+int sgemm_(const char* transa, const char* transb, int* m, int* n, int* k,
+        const float* alpha, const float* a, int* lda, const float* b, int* ldb,
+        float* beta, float* c, int* ldc);
+
 }
 
 template<typename T>
@@ -40,19 +45,6 @@ static void print_parts(const vector<FloatMatrix>& parts) {
     }
 }
 
-static void apply_permutation(float* vec, vector<size_t> permutation) {
-    for (size_t i = 0; i < permutation.size(); i++) {
-        size_t current = i;
-        while (i != permutation[current]) {
-            int next = permutation[current];
-            swap(vec[current], vec[next]);
-            permutation[current] = current;
-            current = next;
-        }
-        permutation[current] = current;
-    }
-}
-
 static vector<FloatMatrix> make_parts(const FloatMatrix& data, size_t parts_count) {
     vector<FloatMatrix> result(parts_count);
     // Ceil division.
@@ -69,112 +61,776 @@ static vector<FloatMatrix> make_parts(const FloatMatrix& data, size_t parts_coun
     }
     for (size_t vec = 0; vec < data.vector_count(); vec++) {
         for (size_t ind = 0; ind < data.vector_length; ind++) {
-            result[ind / len].at(vec, ind % len) = data.at(vec, ind);
+            result[ind / len].cell(vec, ind % len) = data.cell(vec, ind);
         }
     }
     return result;
 }
 
-// Returns best guess of index of vector closest to query.
-static vector<size_t> answer_query(
-        const vector<kmeans_result>& kmeans,
-           const vector<FloatMatrix>& queries,
-           size_t query_number,
-           size_t k_needed = 1) {
+// n x subspace_count indices of the nearest centroids.
+static vector<size_t> assign_l2(const IndexSubspaceQuantization& index, const vector<FloatMatrix>& parts) {
+    size_t n = parts[0].vector_count();
+    size_t part_count = index.subspace_count;
+    vector<size_t> assignment(n * part_count);
+    #pragma omp parallel for
+    for (size_t vec = 0; vec < n; vec++) {
+        for (size_t part = 0; part < part_count; part++) {
+            const FloatMatrix& codebook = index.codebooks[part];
+            float best_dist = HUGE_VALF;
+            for (size_t j = 0; j < codebook.vector_count(); j++) {
+                float dist = faiss::fvec_L2sqr(codebook.row(j), parts[part].row(vec),
+                        codebook.vector_length);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    assignment[vec * part_count + part] = j;
+                }
+            }
+        }
+    }
+    return assignment;
+}
+
+// Weight of the residual parallel to a data point relative to the
+// orthogonal one, for inner product threshold T of normalized vectors
+// ("Accelerating Large-Scale Inference with Anisotropic Vector
+// Quantization", Guo et al. 2020). The loss lives in the rotated space,
+// so its dimension is the rotation's output one.
+static float anisotropic_eta(const IndexSubspaceQuantization& index) {
+    size_t dim = index.rotation.d_out;
+    float t = index.anisotropic_threshold * index.anisotropic_threshold;
+    // eta >= 1 iff T >= 1 / sqrt(dim), a smaller eta would reward parallel
+    // residuals.
+    if (!(t * dim >= 1 && t < 1)) {
+        throw invalid_argument("anisotropic_threshold must be in [1 / sqrt(d), 1)");
+    }
+    return (dim - 1) * t / (1 - t);
+}
+
+static vector<float> squared_norms(const vector<FloatMatrix>& parts) {
+    vector<float> norms(parts[0].vector_count(), 0);
+    for (const auto& part: parts) {
+        for (size_t vec = 0; vec < norms.size(); vec++) {
+            norms[vec] += faiss::fvec_norm_L2sqr(part.row(vec), part.vector_length);
+        }
+    }
+    return norms;
+}
+
+// Improves assignment for the anisotropic loss
+//     |r|^2 + (eta - 1) <r, x>^2 / |x|^2,   r = y - quantized y,
+// by coordinate descent over subspaces, y being the rows of parts and x
+// the data points, the rows of directions. They differ for residual
+// codes, whose parallel error is still the one along the data point. The
+// parallel term couples the subspaces, so every subspace is reassigned
+// with the others fixed.
+static void assign_anisotropic(const IndexSubspaceQuantization& index, const vector<FloatMatrix>& parts,
+        const vector<FloatMatrix>& directions, float eta, vector<size_t>& assignment) {
+    size_t n = parts[0].vector_count();
+    size_t part_count = index.subspace_count;
+    bool residual = &parts != &directions;
+    vector<float> norms = squared_norms(directions);
+    vector<vector<float>> centroid_norms(part_count);
+    for (size_t part = 0; part < part_count; part++) {
+        const FloatMatrix& codebook = index.codebooks[part];
+        for (size_t j = 0; j < codebook.vector_count(); j++) {
+            centroid_norms[part].push_back(
+                    faiss::fvec_norm_L2sqr(codebook.row(j), codebook.vector_length));
+        }
+    }
+
+    const size_t rounds = 2;
+    #pragma omp parallel for
+    for (size_t vec = 0; vec < n; vec++) {
+        if (norms[vec] == 0) {
+            continue;
+        }
+        float weight = (eta - 1) / norms[vec];
+        size_t* assigned = assignment.data() + vec * part_count;
+        // <r, x> restricted to every subspace, and their sum.
+        vector<float> parallel(part_count);
+        float total = 0;
+        for (size_t part = 0; part < part_count; part++) {
+            const FloatMatrix& codebook = index.codebooks[part];
+            size_t len = codebook.vector_length;
+            const float* x = directions[part].row(vec);
+            parallel[part] = faiss::fvec_inner_product(parts[part].row(vec), x, len)
+                    - faiss::fvec_inner_product(codebook.row(assigned[part]), x, len);
+            total += parallel[part];
+        }
+        for (size_t round = 0; round < rounds; round++) {
+            for (size_t part = 0; part < part_count; part++) {
+                const FloatMatrix& codebook = index.codebooks[part];
+                size_t len = codebook.vector_length;
+                const float* y = parts[part].row(vec);
+                const float* x = directions[part].row(vec);
+                float y_norm = faiss::fvec_norm_L2sqr(y, len);
+                float y_dot = residual ? faiss::fvec_inner_product(y, x, len) : y_norm;
+                float others = total - parallel[part];
+                float best_loss = HUGE_VALF;
+                for (size_t j = 0; j < codebook.vector_count(); j++) {
+                    float product = faiss::fvec_inner_product(codebook.row(j), x, len);
+                    float y_product = residual ? faiss::fvec_inner_product(codebook.row(j), y, len) : product;
+                    float dot = y_dot - product + others;
+                    float loss = y_norm - 2 * y_product + centroid_norms[part][j] + weight * dot * dot;
+                    if (loss < best_loss) {
+                        best_loss = loss;
+                        assigned[part] = j;
+                        total = dot;
+                        parallel[part] = y_dot - product;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Solves A x = b for symmetric positive definite n x n A by Cholesky
+// decomposition, in place. Returns false if A is singular.
+static bool solve_spd(vector<double>& a, vector<double>& b, size_t n) {
+    for (size_t j = 0; j < n; j++) {
+        double diagonal = a[j * n + j];
+        for (size_t k = 0; k < j; k++) {
+            diagonal -= a[j * n + k] * a[j * n + k];
+        }
+        if (diagonal <= 0) {
+            return false;
+        }
+        a[j * n + j] = sqrt(diagonal);
+        for (size_t i = j + 1; i < n; i++) {
+            double value = a[i * n + j];
+            for (size_t k = 0; k < j; k++) {
+                value -= a[i * n + k] * a[j * n + k];
+            }
+            a[i * n + j] = value / a[j * n + j];
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < i; k++) {
+            b[i] -= a[i * n + k] * b[k];
+        }
+        b[i] /= a[i * n + i];
+    }
+    for (size_t i = n; i-- > 0;) {
+        for (size_t k = i + 1; k < n; k++) {
+            b[i] -= a[k * n + i] * b[k];
+        }
+        b[i] /= a[i * n + i];
+    }
+    return true;
+}
 
-    assert(kmeans.size() == queries.size());
-    assert(kmeans.size() > 0);
-    size_t part_count = kmeans.size();
-    size_t centroid_count = kmeans[0].centroids.vector_count();
-    size_t vector_count = kmeans[0].assignments.size();
+// Moves every centroid to the minimum of the anisotropic loss of its
+// points, with the other subspaces fixed:
+//     (count I + sum w x x^T) c = sum y + w (<y, x> + s) x,
+// where w = (eta - 1) / |full x|^2 and s is <r, x> of the other subspaces,
+// y and x as in assign_anisotropic.
+static void update_codebooks_anisotropic(IndexSubspaceQuantization& index, const vector<FloatMatrix>& parts,
+        const vector<FloatMatrix>& directions, float eta, const vector<size_t>& assignment) {
+    size_t n = parts[0].vector_count();
+    size_t part_count = index.subspace_count;
+    vector<float> norms = squared_norms(directions);
+    vector<float> parallel(n * part_count);
+    vector<float> total(n, 0);
+    for (size_t vec = 0; vec < n; vec++) {
+        for (size_t part = 0; part < part_count; part++) {
+            const FloatMatrix& codebook = index.codebooks[part];
+            const float* x = directions[part].row(vec);
+            float value = faiss::fvec_inner_product(parts[part].row(vec), x, codebook.vector_length)
+                    - faiss::fvec_inner_product(codebook.row(assignment[vec * part_count + part]),
+                            x, codebook.vector_length);
+            parallel[vec * part_count + part] = value;
+            total[vec] += value;
+        }
+    }
 
-    FloatMatrix table;
-    table.resize(part_count, centroid_count);
+    #pragma omp parallel for
     for (size_t part = 0; part < part_count; part++) {
-        size_t part_length = kmeans[part].centroids.vector_length;
-        assert(part_length == queries[part].vector_length);
+        FloatMatrix& codebook = index.codebooks[part];
+        size_t len = codebook.vector_length;
+        size_t count = codebook.vector_count();
+        vector<vector<double>> a(count, vector<double>(len * len, 0));
+        vector<vector<double>> b(count, vector<double>(len, 0));
+        vector<size_t> sizes(count, 0);
+        for (size_t vec = 0; vec < n; vec++) {
+            size_t j = assignment[vec * part_count + part];
+            const float* y = parts[part].row(vec);
+            const float* x = directions[part].row(vec);
+            double weight = norms[vec] > 0 ? (eta - 1) / norms[vec] : 0;
+            double others = total[vec] - parallel[vec * part_count + part];
+            double factor = weight * (faiss::fvec_inner_product(y, x, len) + others);
+            for (size_t r = 0; r < len; r++) {
+                for (size_t c = 0; c < len; c++) {
+                    a[j][r * len + c] += weight * x[r] * x[c];
+                }
+                b[j][r] += y[r] + factor * x[r];
+            }
+            sizes[j]++;
+        }
+        for (size_t j = 0; j < count; j++) {
+            if (sizes[j] == 0) {
+                continue;
+            }
+            for (size_t r = 0; r < len; r++) {
+                a[j][r * len + r] += sizes[j];
+            }
+            if (solve_spd(a[j], b[j], len)) {
+                for (size_t r = 0; r < len; r++) {
+                    codebook.at(j, r) = b[j][r];
+                }
+            }
+        }
+    }
+}
 
-        for (size_t j = 0; j < centroid_count; j++) {
-            float product = faiss::fvec_inner_product(
-                    kmeans[part].centroids.row(j),
-                    queries[part].row(query_number),
-                    part_length);
-            table.at(part, j) = product;
+// directions are the data points of the rows of parts for the anisotropic
+// loss, parts themselves unless they are residuals.
+static void train_codebooks(IndexSubspaceQuantization& index, const vector<FloatMatrix>& parts,
+        const vector<FloatMatrix>& directions) {
+    // The threshold is checked before the k-means.
+    float eta = index.anisotropic_threshold > 0 ? anisotropic_eta(index) : 1;
+    index.codebooks.resize(index.subspace_count);
+    // Subspaces are independent, k-means of each runs on its own thread.
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t i = 0; i < index.subspace_count; i++) {
+        index.codebooks[i] = perform_kmeans(parts[i], index.centroid_count, index.kmeans_params).centroids;
+    }
+
+    if (index.anisotropic_threshold > 0) {
+        // k-means centroids are the starting point.
+        vector<size_t> assignment = assign_l2(index, parts);
+        for (size_t it = 0; it < index.anisotropic_iterations; it++) {
+            assign_anisotropic(index, parts, directions, eta, assignment);
+            update_codebooks_anisotropic(index, parts, directions, eta, assignment);
         }
     }
+}
+
+static void train_codebooks(IndexSubspaceQuantization& index, const vector<FloatMatrix>& parts) {
+    train_codebooks(index, parts, parts);
+}
 
-    vector<pair<float, faiss::Index::idx_t>> results;
-    for (size_t vec = 0; vec < vector_count; vec++) {
-        float sum = 0;
+// Writes codes of every subspace, codes must be zeroed. directions as in
+// train_codebooks.
+static void encode_parts(const IndexSubspaceQuantization& index, const vector<FloatMatrix>& parts,
+        const vector<FloatMatrix>& directions, uint8_t* codes) {
+    size_t n = parts[0].vector_count();
+    size_t part_count = index.subspace_count;
+    vector<size_t> assignment = assign_l2(index, parts);
+    if (index.anisotropic_threshold > 0) {
+        assign_anisotropic(index, parts, directions, anisotropic_eta(index), assignment);
+    }
+    for (size_t vec = 0; vec < n; vec++) {
         for (size_t part = 0; part < part_count; part++) {
-            sum += table.at(part, kmeans[part].assignments[vec]);
+            set_code(codes + vec * index.code_size, part, assignment[vec * part_count + part], index.nbits);
         }
-        results.emplace_back(sum, vec);
     }
+}
+
+// Inner products of parts of queries [query_begin, query_begin + query_count)
+// with all centroids, query_count x part_count x centroid_count, computed
+// with one sgemm per subspace.
+static void compute_tables(
+        const IndexSubspaceQuantization& index,
+        const vector<FloatMatrix>& queries,
+        size_t query_begin,
+        size_t query_count,
+        vector<float>& tables) {
+
+    size_t part_count = index.subspace_count;
+    size_t centroid_count = index.centroid_count;
+    size_t table_size = part_count * centroid_count;
+    tables.resize(query_count * table_size);
+    for (size_t part = 0; part < part_count; part++) {
+        const FloatMatrix& codebook = index.codebooks[part];
+        int m = centroid_count, n = query_count, len = codebook.vector_length;
+        int ldc = table_size;
+        float one = 1, zero = 0;
+        sgemm_("Transposed", "Not transposed", &m, &n, &len, &one,
+                codebook.data.data(), &len,
+                queries[part].row(query_begin), &len,
+                &zero, tables.data() + part * centroid_count, &ldc);
+    }
+}
+
+static inline float code_score(const IndexSubspaceQuantization& index,
+        const float* tab, const uint8_t* code) {
+    return lut_score(tab, code, index.subspace_count, index.centroid_count, index.nbits);
+}
+
+static inline float norm_of(const IndexSubspaceQuantization& index, size_t vec) {
+    return index.quantize_norms ? index.norm_centroids[index.norm_codes[vec]] : 1;
+}
+
+// Approximate inner product of the query with vector vec.
+static inline float vector_score(const IndexSubspaceQuantization& index,
+        const float* tab, size_t vec) {
+    float score = index.nbits == 4
+            ? fast_scan_lut_score(index.codes.data(), vec, tab, index.subspace_count, index.centroid_count)
+            : code_score(index, tab, index.codes.data() + vec * index.code_size);
+    return norm_of(index, vec) * score;
+}
 
-    if (results.size() > k_needed) {
-        nth_element(results.begin(), results.begin() + k_needed, results.end(),
-                greater<pair<float, faiss::Index::idx_t>>());
-        results.resize(k_needed);
+// Divides rows by their norms, returns the norms.
+static vector<float> normalize_rows(FloatMatrix& x) {
+    vector<float> norms(x.vector_count());
+    #pragma omp parallel for
+    for (size_t i = 0; i < x.vector_count(); i++) {
+        norms[i] = sqrt(faiss::fvec_norm_L2sqr(x.row(i), x.vector_length));
+        if (norms[i] > 0) {
+            scale(x.row(i), norms[i], x.vector_length);
+        }
     }
-    sort(results.rbegin(), results.rend());
-    vector<size_t> ret(results.size());
-    for (size_t i = 0; i < ret.size(); i++) {
-        ret[i] = results[i].second;
+    return norms;
+}
+
+static uint8_t encode_norm(const vector<float>& centroids, float norm) {
+    size_t best = 0;
+    for (size_t j = 1; j < centroids.size(); j++) {
+        if (fabs(centroids[j] - norm) < fabs(centroids[best] - norm)) {
+            best = j;
+        }
     }
+    return best;
+}
+
+typedef TopK<faiss::Index::idx_t> top_t;
 
-    return ret;
+// Returns approximate scores and indices of vectors in [vec_begin, vec_end)
+// closest to query_count queries, given their tables from compute_tables.
+// Every code loaded from memory is scored against all queries of the block.
+static vector<top_t> answer_query_block(
+        const IndexSubspaceQuantization& index,
+           const float* tables,
+           size_t query_count,
+           size_t k_needed,
+           size_t vec_begin,
+           size_t vec_end) {
+
+    size_t part_count = index.subspace_count;
+    size_t centroid_count = index.centroid_count;
+    size_t table_size = part_count * centroid_count;
+
+    vector<top_t> heaps(query_count, top_t(k_needed));
+    // Codes are scanned in chunks that stay in cache while the tables of
+    // all queries of the block go over them. Four queries share every code
+    // lookup, which also gives independent chains of additions. Scores of
+    // a chunk are then filtered against the thresholds of the heaps.
+    const size_t chunk = 1024;
+    vector<float> scores(4 * chunk);
+    const uint8_t* codes = index.codes.data();
+    size_t block_size = fast_scan_block_size(part_count);
+    for (size_t begin = vec_begin; begin < vec_end; begin += chunk) {
+        size_t end = min(vec_end, begin + chunk);
+        size_t q = 0;
+        for (; q + 4 <= query_count; q += 4) {
+            const float* tab = tables + q * table_size;
+            for (size_t vec = begin; vec < end; vec++) {
+                const uint8_t* code = codes + vec * index.code_size;
+                const uint8_t* block = codes + vec / fast_scan_block * block_size;
+                float sum[4] = {0, 0, 0, 0};
+                for (size_t part = 0; part < part_count; part++) {
+                    size_t value = index.nbits == 8 ? code[part]
+                            : fast_scan_code(block, vec % fast_scan_block, part);
+                    const float* entry = tab + part * centroid_count + value;
+                    sum[0] += entry[0];
+                    sum[1] += entry[table_size];
+                    sum[2] += entry[2 * table_size];
+                    sum[3] += entry[3 * table_size];
+                }
+                float norm = norm_of(index, vec);
+                for (size_t i = 0; i < 4; i++) {
+                    scores[i * chunk + vec - begin] = norm * sum[i];
+                }
+            }
+            for (size_t i = 0; i < 4; i++) {
+                heaps[q + i].push_array(scores.data() + i * chunk, end - begin, begin);
+            }
+        }
+        for (; q < query_count; q++) {
+            const float* tab = tables + q * table_size;
+            for (size_t vec = begin; vec < end; vec++) {
+                scores[vec - begin] = vector_score(index, tab, vec);
+            }
+            heaps[q].push_array(scores.data(), end - begin, begin);
+        }
+    }
+    return heaps;
+}
+
+// Same as answer_query_block for one query, but scans the 4-bit codes with
+// a quantized table and re-scores only the best candidates with the float
+// table. vec_begin must be a multiple of fast_scan_block.
+static top_t answer_query_fast_scan(
+        const IndexSubspaceQuantization& index,
+           const float* table,
+           size_t k_needed,
+           size_t vec_begin,
+           size_t vec_end) {
+
+    size_t part_count = index.subspace_count;
+    size_t rerank = max<size_t>(k_needed, k_needed * index.fast_scan_rerank);
+    const uint8_t* blocks = index.codes.data()
+            + vec_begin / fast_scan_block * fast_scan_block_size(part_count);
+    vector<size_t> candidates = fast_scan_candidates(blocks, vec_end - vec_begin,
+            part_count, table, index.centroid_count, rerank,
+            index.quantize_norms ? index.norm_codes.data() + vec_begin : nullptr,
+            index.norm_centroids.data());
+
+    top_t results(k_needed);
+    for (size_t candidate: candidates) {
+        size_t vec = vec_begin + candidate;
+        results.push(vector_score(index, table, vec), vec);
+    }
+    return results;
 }
 
 IndexSubspaceQuantization::IndexSubspaceQuantization(
         size_t dim, size_t subspace_count, size_t centroid_count):
-    Index(dim), subspace_count(subspace_count), centroid_count(centroid_count) {
+    Index(dim), subspace_count(subspace_count), centroid_count(centroid_count),
+    fast_scan(true), fast_scan_rerank(4), query_block(32),
+    anisotropic_threshold(0), anisotropic_iterations(5), train_size(100000),
+    rerank(0), store_vectors(false), quantize_norms(false),
+    intra_query(true), min_shard_size(16384) {
     
-    permutation = prepare_permutation(dim);
+    if (centroid_count > 256) {
+        throw invalid_argument("centroid_count must be at most 256");
+    }
+    nbits = centroid_count <= 16 ? 4 : 8;
+    code_size = (subspace_count * nbits + 7) / 8;
+    rotation = RandomRotation(dim);
+    is_trained = false;
 }
 
-void IndexSubspaceQuantization::add(idx_t n, const float* data) {
-    FloatMatrix data_matrix;
-    data_matrix.resize(n, d);
+void IndexSubspaceQuantization::train(idx_t n, const float* data) {
+    FloatMatrix sample = sample_rows(data, n, d, train_size);
+    cout << "Training " << subspace_count << " subspaces on " << sample.vector_count() << " vectors" << endl;
+    FloatMatrix data_matrix = rotation.apply(sample.data.data(), sample.vector_count());
+    if (quantize_norms) {
+        // Scalar k-means over the norms gives up to 256 levels.
+        vector<float> norms = normalize_rows(data_matrix);
+        FloatMatrix norm_matrix;
+        norm_matrix.resize(norms.size(), 1);
+        norm_matrix.data.assign(norms.begin(), norms.end());
+        FloatMatrix levels = perform_kmeans(norm_matrix, min<size_t>(256, norms.size())).centroids;
+        norm_centroids.assign(levels.data.begin(), levels.data.end());
+    }
+    train_codebooks(*this, make_parts(data_matrix, subspace_count));
+    is_trained = true;
+}
 
-    memcpy(data_matrix.data.data(), data, n * d * sizeof(float));
-    for (idx_t i = 0; i < n; i++) {
-        apply_permutation(data_matrix.row(i), permutation);
+void IndexSubspaceQuantization::add(idx_t n, const float* data) {
+    if (store_vectors && stored_vectors.vector_count() < size_t(ntotal)) {
+        // Earlier vectors would be stored as zeros and re-ranked with zero
+        // scores.
+        throw invalid_argument("store_vectors must be set before the first add");
+    }
+    if (!is_trained) {
+        train(n, data);
     }
 
+    FloatMatrix data_matrix = rotation.apply(data, n);
+    if (quantize_norms) {
+        vector<float> norms = normalize_rows(data_matrix);
+        for (float norm: norms) {
+            norm_codes.push_back(encode_norm(norm_centroids, norm));
+        }
+    }
     vector<FloatMatrix> parts = make_parts(data_matrix, subspace_count);
 
-    kmeans.resize(subspace_count);
-    for(size_t i = 0; i < subspace_count; i++) {
-        cout << "Clustering for part " << i << endl;
-        kmeans[i] = perform_kmeans(parts[i], centroid_count);
+    if (store_vectors) {
+        // Rows are padded to be aligned for the exact inner products.
+        stored_vectors.resize(ntotal + n, d, true);
+        for (idx_t i = 0; i < n; i++) {
+            memcpy(stored_vectors.row(ntotal + i), data + i * d, d * sizeof(float));
+        }
     }
+    if (nbits == 4) {
+        vector<uint8_t> new_codes(n * code_size, 0);
+        encode_parts(*this, parts, parts, new_codes.data());
+        pack_fast_scan_codes(new_codes.data(), ntotal, ntotal + n, subspace_count, codes);
+    } else {
+        codes.resize((ntotal + n) * code_size, 0);
+        encode_parts(*this, parts, parts, codes.data() + ntotal * code_size);
+    }
+    ntotal += n;
 }
 
 void IndexSubspaceQuantization::reset() {
-    kmeans.clear();
-    permutation.clear();
+    codes.clear();
+    norm_codes.clear();
+    stored_vectors.data.clear();
+    ntotal = 0;
+}
+
+// Re-ranks approximate results of query q if possible and writes the best
+// k of them.
+static void write_results(const IndexSubspaceQuantization& index, const MatrixView<float>& originals,
+        bool use_rerank, const float* query, top_t& results,
+        size_t k, float* distances, faiss::Index::idx_t* labels) {
+    if (use_rerank) {
+        top_t exact(k);
+        for (const auto& result: results.entries) {
+            exact.push(faiss::fvec_inner_product(query, originals.row(result.second), index.d),
+                    result.second);
+        }
+        swap(results, exact);
+    }
+    results.sort();
+    for (size_t i = 0; i < k; i++) {
+        bool found = i < results.entries.size();
+        distances[i] = found ? results.entries[i].first : -HUGE_VALF;
+        labels[i] = found ? results.entries[i].second : -1;
+    }
 }
 
 void IndexSubspaceQuantization::search(idx_t n, const float* data, idx_t k,
            float* distances, idx_t* labels) const { 
 
-    FloatMatrix queries;
-    queries.resize(n, d);
-    memcpy(queries.data.data(), data, n * d * sizeof(float));
+    FloatMatrix queries = rotation.apply(data, n);
+
+    vector<FloatMatrix> query_parts = make_parts(queries, subspace_count);
+    bool use_fast_scan = fast_scan && nbits == 4;
+    size_t block = use_fast_scan ? 1 : max<size_t>(query_block, 1);
+    size_t block_count = (n + block - 1) / block;
+
+    // Re-ranking recomputes exact inner products of the best rerank
+    // approximate results.
+    MatrixView<float> originals = stored_vectors.data.empty()
+            ? rerank_vectors : MatrixView<float>(stored_vectors);
+    bool use_rerank = rerank > 0;
+    if (use_rerank && originals.vector_count() < size_t(ntotal)) {
+        throw invalid_argument("rerank needs full-precision vectors of all added vectors");
+    }
+    size_t candidates = use_rerank ? max<size_t>(k, rerank) : k;
+
+    // With fewer queries than threads the codes are split into shards
+    // scanned in parallel, and results of the shards are merged.
+    size_t threads = omp_get_max_threads();
+    size_t shard_count = 1;
+    if (intra_query && size_t(n) < threads) {
+        size_t shard_size = max<size_t>(min_shard_size, 1);
+        shard_count = min(threads, (size_t(ntotal) + shard_size - 1) / shard_size);
+    }
+
+    if (shard_count > 1) {
+        // Shard bounds are aligned to fast-scan blocks.
+        size_t shard_blocks = (ntotal + fast_scan_block - 1) / fast_scan_block;
+        shard_blocks = (shard_blocks + shard_count - 1) / shard_count;
+        // Tables of all queries are computed once and shared by the shards.
+        vector<float> tables;
+        compute_tables(*this, query_parts, 0, n, tables);
+        size_t table_size = subspace_count * centroid_count;
+        // shard x query results.
+        vector<vector<top_t>> partial(shard_count);
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t shard = 0; shard < shard_count; shard++) {
+            size_t begin = min<size_t>(ntotal, shard * shard_blocks * fast_scan_block);
+            size_t end = min<size_t>(ntotal, begin + shard_blocks * fast_scan_block);
+            if (use_fast_scan) {
+                for (idx_t q = 0; q < n; q++) {
+                    partial[shard].push_back(answer_query_fast_scan(*this,
+                            tables.data() + q * table_size, candidates, begin, end));
+                }
+            } else {
+                partial[shard] = answer_query_block(*this, tables.data(), n, candidates, begin, end);
+            }
+        }
+        for (idx_t q = 0; q < n; q++) {
+            top_t merged(candidates);
+            for (size_t shard = 0; shard < shard_count; shard++) {
+                for (const auto& result: partial[shard][q].entries) {
+                    merged.push(result.first, result.second);
+                }
+            }
+            write_results(*this, originals, use_rerank, data + q * d, merged, k,
+                    distances + q * k, labels + q * k);
+        }
+        return;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t b = 0; b < block_count; b++) {
+        size_t begin = b * block, count = min<size_t>(block, n - begin);
+        vector<float> tables;
+        compute_tables(*this, query_parts, begin, count, tables);
+        vector<top_t> ans;
+        if (use_fast_scan) {
+            ans.push_back(answer_query_fast_scan(*this, tables.data(), candidates, 0, ntotal));
+        } else {
+            ans = answer_query_block(*this, tables.data(), count, candidates, 0, ntotal);
+        }
+        for (size_t q = 0; q < count; q++) {
+            write_results(*this, originals, use_rerank, data + (begin + q) * d, ans[q], k,
+                    distances + (begin + q) * k, labels + (begin + q) * k);
+        }
+    }
+}
+
+// Writes the count cells with the nearest centroids to each of the n
+// augmented rows of x, best first.
+static void nearest_cells(const FloatMatrix& centroids, const FloatMatrix& x, size_t count,
+        vector<faiss::Index::idx_t>& cells) {
+    faiss::IndexFlatL2 index(centroids.vector_length);
+    index.add(centroids.vector_count(), centroids.data.data());
+    size_t n = x.vector_count();
+    vector<float> distances(n * count);
+    cells.resize(n * count);
+    index.search(n, x.data.data(), count, distances.data(), cells.data());
+}
+
+// Cell centroid in the space of the vectors.
+static vector<float> cell_centroid(const IndexIVFSubspaceQuantization& index, size_t list) {
+    vector<float> centroid(index.coarse_centroids.row(list), index.coarse_centroids.row(list) + index.d);
+    for (float& value: centroid) {
+        value *= index.augmentation.maxnorm;
+    }
+    return centroid;
+}
+
+// Assigns the n rows of data to their cells and, with residual codes,
+// subtracts the cell centroids from them.
+static vector<faiss::Index::idx_t> assign_cells(const IndexIVFSubspaceQuantization& index,
+        FloatMatrix& data) {
+    size_t n = data.vector_count();
+    FloatMatrix augmented;
+    augmented.resize(n, index.d + 1);
+    index.augmentation.extend_into(data.data.data(), n, augmented.data.data());
+    vector<faiss::Index::idx_t> cells;
+    nearest_cells(index.coarse_centroids, augmented, 1, cells);
+    if (index.by_residual) {
+        vector<vector<float>> centroids(index.nlist);
+        for (size_t list = 0; list < index.nlist; list++) {
+            centroids[list] = cell_centroid(index, list);
+        }
+        #pragma omp parallel for
+        for (size_t i = 0; i < n; i++) {
+            faiss::fvec_madd(index.d, data.row(i), -1, centroids[cells[i]].data(), data.row(i));
+        }
+    }
+    return cells;
+}
+
+IndexIVFSubspaceQuantization::IndexIVFSubspaceQuantization(size_t dim, size_t nlist,
+        size_t subspace_count, size_t centroid_count, bool by_residual):
+    Index(dim), augmentation(dim), quantizer(dim, subspace_count, centroid_count),
+    list_codes(nlist), list_ids(nlist),
+    nlist(nlist), nprobe(1), by_residual(by_residual) {
+
+    quantizer.fast_scan = false;
+    is_trained = false;
+}
+
+void IndexIVFSubspaceQuantization::train(idx_t n, const float* data) {
+    if (quantizer.quantize_norms || quantizer.rerank > 0 || quantizer.store_vectors) {
+        throw invalid_argument("quantize_norms, rerank and store_vectors are not supported with an inverted file");
+    }
+    if (quantizer.fast_scan && quantizer.nbits == 4) {
+        throw invalid_argument("fast_scan is not supported with an inverted file");
+    }
+    FloatMatrix sample = sample_rows(data, n, d, quantizer.train_size);
+    augmentation.train(sample.data.data(), sample.vector_count());
+    FloatMatrix augmented = augmentation.extend(sample.data.data(), sample.vector_count());
+    coarse_centroids = perform_kmeans(augmented, nlist, quantizer.kmeans_params).centroids;
+
+    vector<FloatMatrix> directions;
+    if (by_residual && quantizer.anisotropic_threshold > 0) {
+        // The anisotropic loss of residual codes is along the vectors.
+        directions = make_parts(quantizer.rotation.apply(sample.data.data(), sample.vector_count()),
+                quantizer.subspace_count);
+    }
+    // Residuals to the cells add() will pick, not to the k-means ones.
+    assign_cells(*this, sample);
+    FloatMatrix rotated = quantizer.rotation.apply(sample.data.data(), sample.vector_count());
+    vector<FloatMatrix> parts = make_parts(rotated, quantizer.subspace_count);
+    train_codebooks(quantizer, parts, directions.empty() ? parts : directions);
+    quantizer.is_trained = true;
+    is_trained = true;
+}
+
+void IndexIVFSubspaceQuantization::add(idx_t n, const float* data) {
+    if (!is_trained) {
+        train(n, data);
+    }
+
+    FloatMatrix data_matrix;
+    data_matrix.resize(n, d);
+    memcpy(data_matrix.data.data(), data, n * d * sizeof(float));
+    vector<idx_t> assignments = assign_cells(*this, data_matrix);
+
+    FloatMatrix rotated = quantizer.rotation.apply(data_matrix.data.data(), n);
+    vector<FloatMatrix> parts = make_parts(rotated, quantizer.subspace_count);
+    size_t code_size = quantizer.code_size;
+    vector<uint8_t> codes(n * code_size, 0);
+    vector<FloatMatrix> directions;
+    if (by_residual && quantizer.anisotropic_threshold > 0) {
+        directions = make_parts(quantizer.rotation.apply(data, n), quantizer.subspace_count);
+    }
+    encode_parts(quantizer, parts, directions.empty() ? parts : directions, codes.data());
+
     for (idx_t i = 0; i < n; i++) {
-        apply_permutation(queries.row(i), permutation);
+        size_t list = assignments[i];
+        const uint8_t* code = codes.data() + i * code_size;
+        list_codes[list].insert(list_codes[list].end(), code, code + code_size);
+        list_ids[list].push_back(ntotal + i);
     }
+    ntotal += n;
+}
+
+void IndexIVFSubspaceQuantization::reset() {
+    for (size_t list = 0; list < nlist; list++) {
+        list_codes[list].clear();
+        list_ids[list].clear();
+    }
+    ntotal = 0;
+}
+
+void IndexIVFSubspaceQuantization::search(idx_t n, const float* data, idx_t k,
+           float* distances, idx_t* labels) const {
+
+    FloatMatrix queries = quantizer.rotation.apply(data, n);
+    vector<FloatMatrix> query_parts = make_parts(queries, quantizer.subspace_count);
+    size_t probes = min(nprobe, nlist);
+    // The normalized query, with 0 appended, probes the cells of the nearest
+    // augmented centroids, the same criterion add() assigns vectors by.
+    vector<idx_t> cells;
+    nearest_cells(coarse_centroids, augmentation.extend_queries(data, n), probes, cells);
 
-    vector<FloatMatrix> query_parts = make_parts(queries, subspace_count);
     #pragma omp parallel for
-    for (size_t q = 0; q < queries.vector_count(); q++) {
-        vector<size_t> ans = answer_query(kmeans, query_parts, q, k);
+    for (idx_t q = 0; q < n; q++) {
+
+        // Inner products are linear, so one table serves all cells.
+        vector<float> table;
+        compute_tables(quantizer, query_parts, q, 1, table);
+        const float* tab = table.data();
+
+        // Codes of a cell are scored in chunks, which are filtered against
+        // the heap threshold.
+        const size_t chunk = 1024;
+        vector<float> scores(chunk);
+        top_t heap(k);
+        for (size_t p = 0; p < probes; p++) {
+            size_t list = cells[q * probes + p];
+            // With residual codes the inner product of the query with the
+            // centroid is the base score of all vectors in the cell.
+            float base = by_residual
+                    ? augmentation.maxnorm * faiss::fvec_inner_product(data + q * d, coarse_centroids.row(list), d)
+                    : 0;
+            const uint8_t* codes = list_codes[list].data();
+            size_t size = list_ids[list].size();
+            for (size_t begin = 0; begin < size; begin += chunk) {
+                size_t end = min(size, begin + chunk);
+                for (size_t i = begin; i < end; i++) {
+                    scores[i - begin] = base + code_score(quantizer, tab, codes + i * quantizer.code_size);
+                }
+                heap.push_array(scores.data(), end - begin, list_ids[list].data() + begin);
+            }
+        }
+
+        heap.sort();
         for (size_t i = 0; i < size_t(k); i++) {
-            idx_t lab = (i < ans.size()) ? ans[i] : -1;
-            labels[q * k + i] = lab;
-            // TODO write distances...
+            bool found = i < heap.entries.size();
+            distances[q * k + i] = found ? heap.entries[i].first : -HUGE_VALF;
+            labels[q * k + i] = found ? heap.entries[i].second : -1;
         }
     }
-
 }
@@ -2,16 +2,103 @@
 
 #include "../faiss/Index.h"
 
+#include <cstdint>
+
 
 struct IndexSubspaceQuantization: public faiss::Index {
     IndexSubspaceQuantization(size_t dim, size_t subspace_count, size_t centroid_count);
+    // Learns codebooks on a sample of at most train_size vectors.
+    void train(idx_t n, const float* data);
+    // Encodes and appends vectors, trains on them first if the index is
+    // not trained yet.
     void add(idx_t n, const float* data);
     void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels) const;
     void reset();
-    // void train(idx_t n, const float* data);
     
-    std::vector<kmeans_result> kmeans;
-    std::vector<size_t> permutation;
+    // Codebook of every subspace, centroid_count x subspace length.
+    std::vector<FloatMatrix> codebooks;
+    // ntotal x code_size codes. With centroid_count <= 16 codes are 4-bit
+    // and stored in fast-scan block layout instead, see fastscan.h.
+    std::vector<uint8_t> codes;
+    // Applied to data and queries before splitting them into subspaces,
+    // balances variance across subspaces.
+    RandomRotation rotation;
     // Parameters:
     size_t subspace_count, centroid_count;
+    // Bits per subspace code (4 or 8) and bytes per vector.
+    size_t nbits, code_size;
+    // With 4-bit codes, search with quantized tables and re-score the best
+    // fast_scan_rerank * k candidates with float tables.
+    bool fast_scan;
+    size_t fast_scan_rerank;
+    // Queries scored together against every code without fast-scan.
+    size_t query_block;
+    // If positive, codebooks and codes minimize the score-aware (anisotropic)
+    // loss, which penalizes residuals parallel to the data points more, for
+    // inner products of normalized vectors near this threshold (e.g. 0.2).
+    // Otherwise plain k-means is used. A positive threshold must be at least
+    // 1 / sqrt(d), d being rounded up to a power of two by the rotation, and
+    // below 1; training throws std::invalid_argument otherwise.
+    float anisotropic_threshold;
+    size_t anisotropic_iterations;
+    // 0 trains on all vectors.
+    size_t train_size;
+    // k-means of the codebooks, also of the IVF coarse quantizer.
+    KmeansParams kmeans_params;
+    // If positive, the best rerank approximate results are scored exactly
+    // before the best k are kept. search() throws std::invalid_argument if
+    // full-precision vectors do not cover all ntotal vectors.
+    size_t rerank;
+    // Keep a copy of added vectors in stored_vectors for re-ranking. Must be
+    // set before the first add(), which throws std::invalid_argument if
+    // earlier vectors were not stored. Without it, rerank_vectors may point
+    // to the vectors kept elsewhere, e.g. in a MappedFile, row i being the
+    // i-th added vector.
+    bool store_vectors;
+    FloatMatrix stored_vectors;
+    MatrixView<float> rerank_vectors;
+    // Encode directions x / |x| with the codebooks and norms separately with
+    // 8 bits, approximate scores are norm * table sum. Set before training.
+    bool quantize_norms;
+    // Norm levels and the norm code of every vector.
+    std::vector<float> norm_centroids;
+    std::vector<uint8_t> norm_codes;
+    // With fewer queries than threads, split codes into shards of at least
+    // min_shard_size vectors and scan them in parallel for every query.
+    bool intra_query;
+    size_t min_shard_size;
+};
+
+// Inverted file in front of subspace quantization: vectors are assigned to
+// nlist cells of a coarse quantizer and only the nprobe best cells are
+// scanned. The coarse quantizer is k-means on MIPS-augmented vectors, and
+// both vectors and queries go to the cells of the nearest augmented
+// centroids, so a query probes the cells its best matches were put in.
+struct IndexIVFSubspaceQuantization: public faiss::Index {
+    IndexIVFSubspaceQuantization(size_t dim, size_t nlist, size_t subspace_count,
+            size_t centroid_count, bool by_residual = true);
+    // Trains on a sample of at most quantizer.train_size vectors. Throws
+    // std::invalid_argument for quantizer options the inverted file does
+    // not support: quantize_norms, rerank, store_vectors and fast_scan with
+    // 4-bit codes.
+    void train(idx_t n, const float* data);
+    // Trains on the data first if the index is not trained yet.
+    void add(idx_t n, const float* data);
+    void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels) const;
+    void reset();
+
+    // Scales vectors by 1 / maxnorm and appends sqrt(1 - |x|^2).
+    MipsAugmentationNeyshabur augmentation;
+    // nlist x (d + 1) centroids of the augmented vectors.
+    FloatMatrix coarse_centroids;
+    // Encodes vectors, or their residuals to the first d coordinates of the
+    // cell centroids times maxnorm. Its own codes are not used, nor is
+    // fast_scan, which the constructor clears.
+    IndexSubspaceQuantization quantizer;
+    // Codes and ids of the vectors of every cell.
+    std::vector<std::vector<uint8_t>> list_codes;
+    std::vector<std::vector<idx_t>> list_ids;
+    // Parameters:
+    size_t nlist, nprobe;
+    bool by_residual;
 };
@@ -0,0 +1,197 @@
+#include "reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static bool ends_with(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void read_fully(int fd, char* buf, size_t size, off_t offset, const string& filename) {
+    while (size > 0) {
+        ssize_t got = pread(fd, buf, size, offset);
+        if (got <= 0) {
+            throw runtime_error("Failed to read file " + filename);
+        }
+        buf += got;
+        size -= got;
+        offset += got;
+    }
+}
+
+// Reads the next line that is not blank, returns false at the end of the
+// file.
+static bool next_line(ifstream& text, string& line) {
+    while (getline(text, line)) {
+        if (!is_blank_line(line.data(), line.data() + line.size())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ChunkedReader::ChunkedReader(const string& filename, size_t batch_size):
+    batch_size(batch_size), dim(0), count(0), filename(filename), fd(-1), rows_read(0),
+    has_ready(false), done(false), stop(false) {
+
+    if (batch_size == 0) {
+        throw invalid_argument("batch_size must be positive");
+    }
+    if (ends_with(filename, ".fvecs") || ends_with(filename, ".bvecs")) {
+        format = ends_with(filename, ".fvecs") ? FORMAT_FVECS : FORMAT_BVECS;
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw runtime_error("Failed to open file " + filename);
+        }
+        struct stat st;
+        uint32_t header;
+        if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            close(fd);
+            throw runtime_error("Failed to read file " + filename);
+        }
+        dim = header;
+        size_t row_size = sizeof(header) + dim * (format == FORMAT_FVECS ? sizeof(float) : 1);
+        if (st.st_size % row_size != 0) {
+            close(fd);
+            throw runtime_error("Wrong file size of " + filename);
+        }
+        count = st.st_size / row_size;
+        // Whole file is read once from start to end.
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    } else {
+        format = FORMAT_TEXT;
+        // Validated like by load_text_file.
+        text.open(filename);
+        string line;
+        getline(text, line);
+        const char* p = line.data();
+        const char* end = p + line.size();
+        if (text.fail() || !parse_count(p, end, count) || !parse_count(p, end, dim) || dim < 1
+                || count > numeric_limits<size_t>::max() / sizeof(float) / dim) {
+            throw runtime_error("Failed to read header of " + filename);
+        }
+    }
+    worker = thread(&ChunkedReader::read_loop, this);
+}
+
+ChunkedReader::~ChunkedReader() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+bool ChunkedReader::read_batch(FloatMatrix& batch) {
+    size_t rows = min(batch_size, count - rows_read);
+    string line;
+    if (rows == 0) {
+        if (format == FORMAT_TEXT && next_line(text, line)) {
+            throw runtime_error("Wrong row count in " + filename);
+        }
+        return false;
+    }
+    batch.resize(rows, dim);
+    if (format == FORMAT_TEXT) {
+        // One row per line, exactly dim numbers each.
+        for (size_t i = 0; i < rows; i++) {
+            if (!next_line(text, line)) {
+                throw runtime_error("Wrong row count in " + filename);
+            }
+            const char* p = line.data();
+            const char* end = p + line.size();
+            float* out = batch.row(i);
+            double value;
+            for (size_t j = 0; j < dim; j++) {
+                if (!parse_number(p, end, value)) {
+                    throw runtime_error("Failed to parse " + filename);
+                }
+                out[j] = float(value);
+            }
+            if (!is_blank_line(p, end)) {
+                throw runtime_error("Failed to parse " + filename);
+            }
+        }
+    } else {
+        size_t value_size = format == FORMAT_FVECS ? sizeof(float) : 1;
+        size_t row_size = sizeof(uint32_t) + dim * value_size;
+        off_t offset = rows_read * row_size;
+        // Kernel starts reading the batch after this one while this one is
+        // converted, and drops pages of the previous one from the cache.
+        posix_fadvise(fd, offset + rows * row_size, rows * row_size, POSIX_FADV_WILLNEED);
+        vector<char> raw(rows * row_size);
+        read_fully(fd, raw.data(), raw.size(), offset, filename);
+        for (size_t i = 0; i < rows; i++) {
+            const char* row = raw.data() + i * row_size;
+            uint32_t row_dim;
+            memcpy(&row_dim, row, sizeof(row_dim));
+            if (row_dim != dim) {
+                throw runtime_error("Inconsistent dimensions in " + filename);
+            }
+            if (format == FORMAT_FVECS) {
+                memcpy(batch.row(i), row + sizeof(row_dim), dim * sizeof(float));
+            } else {
+                const uint8_t* values = (const uint8_t*) (row + sizeof(row_dim));
+                copy(values, values + dim, batch.row(i));
+            }
+        }
+        posix_fadvise(fd, offset, rows * row_size, POSIX_FADV_DONTNEED);
+    }
+    rows_read += rows;
+    return true;
+}
+
+void ChunkedReader::read_loop() {
+    FloatMatrix batch;
+    try {
+        while (true) {
+            bool more = read_batch(batch);
+            unique_lock<std::mutex> lock(mutex);
+            // Wait until the previous batch is taken.
+            cv.wait(lock, [this] { return !has_ready || stop; });
+            if (stop) {
+                return;
+            }
+            if (!more) {
+                done = true;
+                cv.notify_all();
+                return;
+            }
+            swap(ready, batch);
+            has_ready = true;
+            cv.notify_all();
+        }
+    } catch (...) {
+        lock_guard<std::mutex> lock(mutex);
+        error = current_exception();
+        done = true;
+        cv.notify_all();
+    }
+}
+
+bool ChunkedReader::next(FloatMatrix& batch) {
+    unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return has_ready || done; });
+    if (has_ready) {
+        swap(batch, ready);
+        has_ready = false;
+        cv.notify_all();
+        return true;
+    }
+    if (error) {
+        rethrow_exception(error);
+    }
+    return false;
+}
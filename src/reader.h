@@ -0,0 +1,55 @@
+#ifndef READER_H_
+#define READER_H_
+
+#include "common.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+// Reads a dataset in batches of at most batch_size rows converted to float,
+// so memory stays bounded whatever the size of the dataset. A background
+// thread reads the next batch while the caller processes the current one.
+// Supports .fvecs, .bvecs and the text format of load_text_file. Throws
+// std::runtime_error on malformed input, from next() for errors found while
+// reading.
+struct ChunkedReader {
+    ChunkedReader(const std::string& filename, size_t batch_size);
+    ~ChunkedReader();
+
+    // Replaces batch with the next rows, returns false after the last one.
+    bool next(FloatMatrix& batch);
+
+    size_t batch_size;
+    size_t dim;
+    size_t count;
+
+private:
+    enum format_t { FORMAT_FVECS, FORMAT_BVECS, FORMAT_TEXT };
+
+    bool read_batch(FloatMatrix& batch);
+    void read_loop();
+
+    format_t format;
+    std::string filename;
+    int fd;
+    std::ifstream text;
+    size_t rows_read;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    FloatMatrix ready;
+    bool has_ready, done, stop;
+    std::exception_ptr error;
+
+    ChunkedReader(const ChunkedReader&) = delete;
+    ChunkedReader& operator=(const ChunkedReader&) = delete;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "residual.h"
+
+#include "common.h"
+#include "fastscan.h"
+#include "topk.h"
+
+#include "../faiss/utils.h"
+#include "../faiss/IndexFlat.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// Finds the nearest centroid of every residual and subtracts it.
+static vector<size_t> assign_and_subtract(const FloatMatrix& codebook, FloatMatrix& residuals) {
+    size_t n = residuals.vector_count();
+    size_t d = residuals.vector_length;
+    faiss::IndexFlatL2 index(d);
+    index.add(codebook.vector_count(), codebook.data.data());
+    vector<float> dist(n);
+    vector<faiss::Index::idx_t> labels(n);
+    index.search(n, residuals.data.data(), 1, dist.data(), labels.data());
+
+    vector<size_t> assignment(n);
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++) {
+        assignment[i] = labels[i];
+        faiss::fvec_madd(d, residuals.row(i), -1, codebook.row(labels[i]), residuals.row(i));
+    }
+    return assignment;
+}
+
+// Sum of table entries selected by the code of vector vec.
+static inline float code_score(const IndexResidualQuantization& index, const float* table,
+        size_t vec) {
+    if (index.nbits == 4) {
+        return fast_scan_lut_score(index.codes.data(), vec, table,
+                index.codebook_count, index.centroid_count);
+    }
+    return lut_score(table, index.codes.data() + vec * index.code_size,
+            index.codebook_count, index.centroid_count, index.nbits);
+}
+
+IndexResidualQuantization::IndexResidualQuantization(
+        size_t dim, size_t codebook_count, size_t centroid_count):
+    Index(dim), codebook_count(codebook_count), centroid_count(centroid_count),
+    fast_scan(true), fast_scan_rerank(4), train_size(100000) {
+
+    if (centroid_count > 256) {
+        throw invalid_argument("centroid_count must be at most 256");
+    }
+    nbits = centroid_count <= 16 ? 4 : 8;
+    code_size = (codebook_count * nbits + 7) / 8;
+    is_trained = false;
+}
+
+void IndexResidualQuantization::train(idx_t n, const float* data) {
+    FloatMatrix residuals = sample_rows(data, n, d, train_size);
+    codebooks.resize(codebook_count);
+    for (size_t i = 0; i < codebook_count; i++) {
+        cout << "Clustering for codebook " << i << endl;
+        codebooks[i] = perform_kmeans(residuals, centroid_count, kmeans_params).centroids;
+        assign_and_subtract(codebooks[i], residuals);
+    }
+    is_trained = true;
+}
+
+void IndexResidualQuantization::add(idx_t n, const float* data) {
+    if (!is_trained) {
+        train(n, data);
+    }
+
+    // Codes are chosen greedily, one codebook after another.
+    FloatMatrix residuals;
+    residuals.resize(n, d);
+    memcpy(residuals.data.data(), data, n * d * sizeof(float));
+    vector<uint8_t> new_codes(n * code_size, 0);
+    for (size_t i = 0; i < codebook_count; i++) {
+        vector<size_t> assignment = assign_and_subtract(codebooks[i], residuals);
+        for (idx_t vec = 0; vec < n; vec++) {
+            set_code(new_codes.data() + vec * code_size, i, assignment[vec], nbits);
+        }
+    }
+    if (nbits == 4) {
+        pack_fast_scan_codes(new_codes.data(), ntotal, ntotal + n, codebook_count, codes);
+    } else {
+        codes.insert(codes.end(), new_codes.begin(), new_codes.end());
+    }
+    ntotal += n;
+}
+
+void IndexResidualQuantization::reset() {
+    codes.clear();
+    ntotal = 0;
+}
+
+void IndexResidualQuantization::search(idx_t n, const float* data, idx_t k,
+           float* distances, idx_t* labels) const {
+
+    bool use_fast_scan = fast_scan && nbits == 4;
+
+    #pragma omp parallel for
+    for (idx_t q = 0; q < n; q++) {
+        const float* query = data + q * d;
+        vector<float> table(codebook_count * centroid_count);
+        for (size_t i = 0; i < codebook_count; i++) {
+            for (size_t j = 0; j < centroid_count; j++) {
+                table[i * centroid_count + j] =
+                        faiss::fvec_inner_product(query, codebooks[i].row(j), d);
+            }
+        }
+
+        TopK<idx_t> results(k);
+        if (use_fast_scan) {
+            size_t count = max<size_t>(k, k * fast_scan_rerank);
+            vector<size_t> candidates = fast_scan_candidates(codes.data(), ntotal,
+                    codebook_count, table.data(), centroid_count, count);
+            for (size_t vec: candidates) {
+                results.push(code_score(*this, table.data(), vec), vec);
+            }
+        } else {
+            const size_t chunk = 1024;
+            float scores[chunk];
+            for (idx_t begin = 0; begin < ntotal; begin += chunk) {
+                size_t count = min<size_t>(chunk, ntotal - begin);
+                for (size_t i = 0; i < count; i++) {
+                    scores[i] = code_score(*this, table.data(), begin + i);
+                }
+                results.push_array(scores, count, begin);
+            }
+        }
+
+        results.sort();
+        for (size_t i = 0; i < size_t(k); i++) {
+            bool found = i < results.entries.size();
+            distances[q * k + i] = found ? results.entries[i].first : -HUGE_VALF;
+            labels[q * k + i] = found ? results.entries[i].second : -1;
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#include "common.h"
+
+#include "../faiss/Index.h"
+
+#include <cstdint>
+
+
+// Residual (additive) quantization: a vector is approximated by the sum of
+// one centroid from each of codebook_count codebooks. Every codebook spans
+// all dimensions and is trained on the residuals left by the previous ones,
+// so an inner product is a sum of per-codebook table entries.
+struct IndexResidualQuantization: public faiss::Index {
+    IndexResidualQuantization(size_t dim, size_t codebook_count, size_t centroid_count);
+    // Learns codebooks on a sample of at most train_size vectors.
+    void train(idx_t n, const float* data);
+    // Encodes and appends vectors, trains on them first if the index is
+    // not trained yet.
+    void add(idx_t n, const float* data);
+    // Distances are approximate inner products.
+    void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels) const;
+    void reset();
+
+    // centroid_count x d centroids of every codebook.
+    std::vector<FloatMatrix> codebooks;
+    // ntotal x code_size codes, laid out as in IndexSubspaceQuantization:
+    // 4-bit codes are in fast-scan block layout.
+    std::vector<uint8_t> codes;
+    // Parameters:
+    size_t codebook_count, centroid_count;
+    // Bits per codebook code (4 or 8) and bytes per vector.
+    size_t nbits, code_size;
+    // With 4-bit codes, search with quantized tables and re-score the best
+    // fast_scan_rerank * k candidates with float tables.
+    bool fast_scan;
+    size_t fast_scan_rerank;
+    // 0 trains on all vectors.
+    size_t train_size;
+    KmeansParams kmeans_params;
+};
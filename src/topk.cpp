@@ -0,0 +1,40 @@
+#include "topk.h"
+
+#include "common.h"
+
+#include <immintrin.h>
+
+using namespace std;
+
+static size_t filter_scores_ref(const float* scores, size_t begin, size_t n, float threshold,
+        uint32_t* out) {
+    size_t count = 0;
+    for (size_t i = begin; i < n; i++) {
+        out[count] = i;
+        count += scores[i] >= threshold;
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static size_t filter_scores_avx2(const float* scores, size_t n, float threshold, uint32_t* out) {
+    __m256 t = _mm256_set1_ps(threshold);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 ge = _mm256_cmp_ps(_mm256_loadu_ps(scores + i), t, _CMP_GE_OQ);
+        unsigned mask = _mm256_movemask_ps(ge);
+        while (mask) {
+            out[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return count + filter_scores_ref(scores, i, n, threshold, out + count);
+}
+
+size_t filter_scores(const float* scores, size_t n, float threshold, uint32_t* out) {
+    if (simd_level() != SIMD_NONE) {
+        return filter_scores_avx2(scores, n, threshold, out);
+    }
+    return filter_scores_ref(scores, 0, n, threshold, out);
+}
@@ -0,0 +1,123 @@
+#ifndef TOPK_H_
+#define TOPK_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+
+// Writes positions of scores not below threshold to out, in increasing
+// order, and returns their count. out has room for n positions.
+size_t filter_scores(const float* scores, size_t n, float threshold, uint32_t* out);
+
+// Keeps the k best (score, id) pairs pushed into it in a min-heap, so that
+// the candidates of a scan are never materialized. Once k pairs are kept,
+// the worst of them is a threshold that rejects most later candidates with
+// a single comparison. Ties of scores are broken by larger id, so the kept
+// set does not depend on the order of pushes.
+template <typename Id>
+struct TopK {
+    typedef std::pair<float, Id> entry_t;
+
+    explicit TopK(size_t k = 0);
+
+    // Empties the heap and sets k, keeping allocated memory.
+    void reset(size_t new_k);
+
+    bool full() const;
+    // Worst kept score if full, -inf otherwise.
+    float threshold() const;
+
+    void push(float score, Id id);
+    // Pushes scores[i] with id first + i. Once the heap is full, scores are
+    // filtered against the threshold with SIMD before pushing.
+    void push_array(const float* scores, size_t n, Id first);
+    // Same with id ids[i] for scores[i].
+    void push_array(const float* scores, size_t n, const Id* ids);
+
+    // Sorts entries best first. Nothing can be pushed until reset.
+    void sort();
+
+    size_t k;
+    std::vector<entry_t> entries;
+};
+
+template <typename Id>
+TopK<Id>::TopK(size_t k): k(k) {
+    entries.reserve(k + 1);
+}
+
+template <typename Id>
+void TopK<Id>::reset(size_t new_k) {
+    k = new_k;
+    entries.clear();
+    entries.reserve(k + 1);
+}
+
+template <typename Id>
+bool TopK<Id>::full() const {
+    return entries.size() >= k;
+}
+
+template <typename Id>
+float TopK<Id>::threshold() const {
+    return full() && k > 0 ? entries.front().first : -HUGE_VALF;
+}
+
+template <typename Id>
+void TopK<Id>::push(float score, Id id) {
+    entry_t entry(score, id);
+    if (entries.size() < k) {
+        entries.push_back(entry);
+        std::push_heap(entries.begin(), entries.end(), std::greater<entry_t>());
+    } else if (k > 0 && entries.front() < entry) {
+        std::pop_heap(entries.begin(), entries.end(), std::greater<entry_t>());
+        entries.back() = entry;
+        std::push_heap(entries.begin(), entries.end(), std::greater<entry_t>());
+    }
+}
+
+template <typename Id>
+void TopK<Id>::push_array(const float* scores, size_t n, Id first) {
+    size_t i = 0;
+    for (; i < n && !full(); i++) {
+        push(scores[i], first + i);
+    }
+    const size_t chunk = 256;
+    uint32_t positions[chunk];
+    for (; i < n; i += chunk) {
+        size_t len = std::min(chunk, n - i);
+        size_t count = filter_scores(scores + i, len, threshold(), positions);
+        for (size_t j = 0; j < count; j++) {
+            push(scores[i + positions[j]], first + (i + positions[j]));
+        }
+    }
+}
+
+template <typename Id>
+void TopK<Id>::push_array(const float* scores, size_t n, const Id* ids) {
+    size_t i = 0;
+    for (; i < n && !full(); i++) {
+        push(scores[i], ids[i]);
+    }
+    const size_t chunk = 256;
+    uint32_t positions[chunk];
+    for (; i < n; i += chunk) {
+        size_t len = std::min(chunk, n - i);
+        size_t count = filter_scores(scores + i, len, threshold(), positions);
+        for (size_t j = 0; j < count; j++) {
+            push(scores[i + positions[j]], ids[i + positions[j]]);
+        }
+    }
+}
+
+template <typename Id>
+void TopK<Id>::sort() {
+    std::sort_heap(entries.begin(), entries.end(), std::greater<entry_t>());
+}
+
+#endif
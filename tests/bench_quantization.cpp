@@ -2,11 +2,22 @@
 #include "../src/bench.h"
 #include "../src/quantization.h"
 
+// arguments guide
+//argc=  0                  1              2             3      4        5
+// bench_quantization subspace_count centroid_count
+//                    subspace_count centroid_count  nlist  nprobe1  nprobe2  ...
+
 size_t subspace_count;
 size_t centroid_count;
+size_t nlist;
 
 faiss::Index* get_trained_index(const FloatMatrix& xt) {
-    faiss::Index* index = new IndexSubspaceQuantization(xt.vector_length, subspace_count, centroid_count);
+    faiss::Index* index;
+    if (nlist > 0) {
+        index = new IndexIVFSubspaceQuantization(xt.vector_length, nlist, subspace_count, centroid_count);
+    } else {
+        index = new IndexSubspaceQuantization(xt.vector_length, subspace_count, centroid_count);
+    }
     index->train(xt.vector_count(), xt.data.data());
     return index;
 }
@@ -17,8 +28,25 @@ int main(int argc, char **argv) {
     } else {
         subspace_count = atoi(argv[1]);
         centroid_count = atoi(argv[2]);
+        nlist = argc > 3 ? atoi(argv[3]) : 0;
         faiss::Index* index = bench_train(get_trained_index);
-        bench_add(index);
-        bench_query(index);
+        bench_add_chunked(index, 100000);
+        if (nlist == 0) {
+            bench_query(index);
+        } else {
+            // Without nprobe arguments only the best cell is probed.
+            std::vector<size_t> nprobes;
+            for (int i = 4; i < argc; i++) {
+                nprobes.push_back(atoi(argv[i]));
+            }
+            if (nprobes.empty()) {
+                nprobes.push_back(1);
+            }
+            for (size_t nprobe: nprobes) {
+                printf("Querying using nprobe = %zu\n", nprobe);
+                static_cast<IndexIVFSubspaceQuantization*>(index)->nprobe = nprobe;
+                bench_query(index);
+            }
+        }
     }
 }
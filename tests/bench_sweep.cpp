@@ -0,0 +1,241 @@
+#include "../src/common.h"
+#include "../src/bench.h"
+#include "../src/quantization.h"
+#include "../src/kmeans.h"
+#include "../src/alsh.h"
+
+#include "../faiss/AutoTune.h"
+
+#include <sstream>
+#include <stdexcept>
+
+// Builds one index, then sweeps its search-time parameters and writes
+// recall, QPS and latency percentiles of every setting, with the Pareto
+// frontier of R@10 vs QPS marked. Latencies follow BENCH_CLIENTS,
+// BENCH_BATCH etc. as in bench_query.
+
+// arguments guide
+//argc=  0           1       2        3         4         5      6       7
+// bench_sweep  output.csv  quant  subspace  centroid  [nlist]
+//              output.csv  kmeans  layers   augtype     U
+//              output.csv  alsh      L         K        r   augtype   U
+//              output.csv  faiss
+// Output is JSON if its name ends with .json.
+
+typedef std::vector<std::pair<std::string, std::string>> params_t;
+
+const size_t nprobe_values[] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048};
+const size_t rerank_values[] = {0, 200, 500, 1000};
+const size_t opened_trees_values[] = {10, 20, 30, 40, 50, 60, 70, 80};
+const size_t candidate_budget_values[] = {0, 10000, 50000}; // 0 is unlimited
+
+size_t m = 3; // additional vector dimensions
+std::string algorithm;
+size_t subspace_count, centroid_count, nlist;
+size_t layers_count;
+size_t L, K; // hash tables, hash functions in one table
+float r; // hash function parameter
+int augtype; // augmentation type
+float U; // vector scaling coefficient
+
+FloatMatrix queries;
+FlatMatrix<faiss::Index::idx_t> ground_truth;
+params_t build_params;
+double rss_growth_mb;
+std::vector<SweepRow> rows;
+
+template <typename T>
+std::string to_string(T value) {
+    std::ostringstream out;
+    out << value;
+    return out.str();
+}
+
+faiss::Index* get_trained_index(const FloatMatrix& xt) {
+    size_t dim = xt.vector_length;
+    faiss::Index* index;
+    if (algorithm == "quant") {
+        if (nlist > 0) {
+            index = new IndexIVFSubspaceQuantization(dim, nlist, subspace_count, centroid_count);
+        } else {
+            index = new IndexSubspaceQuantization(dim, subspace_count, centroid_count);
+        }
+    } else if (algorithm == "faiss") {
+        index = faiss::index_factory(dim, "IVF4096,Flat", faiss::METRIC_INNER_PRODUCT);
+    } else {
+        MipsAugmentation* aug;
+        switch (augtype) {
+        case 0: aug = new MipsAugmentationNeyshabur(dim); break;
+        case 1: aug = new MipsAugmentationShrivastava(dim, m, U); break;
+        case 2: aug = new MipsAugmentationNone(dim); break;
+        default: exit(1);
+        }
+        if (algorithm == "kmeans") {
+            index = new IndexHierarchicKmeans(dim, layers_count, 1, aug);
+        } else {
+            index = new IndexALSH(dim, L, K, r, aug);
+        }
+    }
+    index->train(xt.vector_count(), xt.data.data());
+    return index;
+}
+
+// Searches an HKM index with fixed parameters, so that bench_latency can
+// time it like any other index.
+struct HKMSearch: public faiss::Index {
+    HKMSearch(const IndexHierarchicKmeans* index, const SearchParametersHKM& params):
+        faiss::Index(index->d, index->metric_type), index(index), params(params) {
+        ntotal = index->ntotal;
+    }
+    void add(idx_t, const float*) {
+        throw std::logic_error("HKMSearch does not support add");
+    }
+    void search(idx_t n, const float* data, idx_t k, float* distances, idx_t* labels) const {
+        index->search(n, data, k, distances, labels, params);
+    }
+    void reset() {}
+
+    const IndexHierarchicKmeans* index;
+    SearchParametersHKM params;
+};
+
+void measure(const faiss::Index* index, const params_t& search_params) {
+    SweepRow row;
+    row.params = build_params;
+    row.params.insert(row.params.end(), search_params.begin(), search_params.end());
+    for (const auto& param: row.params) {
+        printf("%s=%s ", param.first.c_str(), param.second.c_str());
+    }
+    printf("\n");
+
+    size_t nq = queries.vector_count();
+    size_t k = ground_truth.vector_length;
+    std::vector<faiss::Index::idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    double begin_search = elapsed();
+    index->search(nq, queries.data.data(), k, D.data(), I.data());
+    row.search_time = elapsed() - begin_search;
+    row.recall = bench_recall(ground_truth, I.data(), k);
+
+    LatencyParams params = latency_params_from_env();
+    params.k = k;
+    row.latency = bench_latency(index, queries, params);
+    row.rss_growth_mb = rss_growth_mb;
+    printf("R@10 = %.6f, QPS = %.3f, Latency p99 [ms] = %.6f\n", row.recall.r10,
+            row.latency.qps, row.latency.histogram.percentile(0.99) * 1e3);
+    rows.push_back(row);
+}
+
+// Re-ranking maps the base file as floats, which only works for .fvecs:
+// the base set may also be .bvecs or text, see ChunkedReader.
+bool has_float_base() {
+    const std::string& name = filenames[1];
+    return name.size() >= 6 && name.compare(name.size() - 6, 6, ".fvecs") == 0;
+}
+
+void sweep(faiss::Index* index) {
+    if (algorithm == "quant" && nlist > 0) {
+        IndexIVFSubspaceQuantization* ivf = (IndexIVFSubspaceQuantization*) index;
+        for (size_t nprobe: nprobe_values) {
+            if (nprobe > nlist) {
+                break;
+            }
+            ivf->nprobe = nprobe;
+            measure(index, {{"nprobe", to_string(nprobe)}});
+        }
+    } else if (algorithm == "quant" && !has_float_base()) {
+        printf("Base vectors are not in .fvecs, skipping the rerank sweep\n");
+        measure(index, {{"rerank", "0"}});
+    } else if (algorithm == "quant") {
+        // Re-ranking reads the base vectors from the mapped file instead of
+        // a copy in the index.
+        MappedMatrix<float> base(filenames[1]);
+        IndexSubspaceQuantization* isq = (IndexSubspaceQuantization*) index;
+        isq->rerank_vectors = base.view;
+        for (size_t rerank: rerank_values) {
+            isq->rerank = rerank;
+            measure(index, {{"rerank", to_string(rerank)}});
+        }
+        isq->rerank = 0;
+        isq->rerank_vectors = MatrixView<float>();
+    } else if (algorithm == "kmeans") {
+        const IndexHierarchicKmeans* hkm = (const IndexHierarchicKmeans*) index;
+        for (size_t opened_trees: opened_trees_values) {
+            for (size_t budget: candidate_budget_values) {
+                HKMSearch search(hkm, SearchParametersHKM(opened_trees, budget));
+                measure(&search, {{"opened_trees", to_string(opened_trees)},
+                        {"candidate_budget", to_string(budget)}});
+            }
+        }
+    } else if (algorithm == "faiss") {
+        faiss::ParameterSpace space;
+        for (size_t nprobe: nprobe_values) {
+            space.set_index_parameters(index, ("nprobe=" + to_string(nprobe)).c_str());
+            measure(index, {{"nprobe", to_string(nprobe)}});
+        }
+    } else {
+        // ALSH has no search-time parameters.
+        measure(index, {});
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("Arguments missing, terminating.\n");
+        return 1;
+    }
+    std::string output = argv[1];
+    algorithm = argv[2];
+    build_params.push_back({"algorithm", algorithm});
+    if (algorithm == "quant" && argc >= 5) {
+        subspace_count = atoi(argv[3]);
+        centroid_count = atoi(argv[4]);
+        nlist = argc > 5 ? atoi(argv[5]) : 0;
+        build_params.push_back({"subspace_count", argv[3]});
+        build_params.push_back({"centroid_count", argv[4]});
+        build_params.push_back({"nlist", to_string(nlist)});
+    } else if (algorithm == "kmeans" && argc >= 6) {
+        layers_count = atoi(argv[3]);
+        augtype = atoi(argv[4]);
+        sscanf(argv[5], "%f", &U);
+        build_params.push_back({"layers", argv[3]});
+        build_params.push_back({"augtype", argv[4]});
+        build_params.push_back({"U", argv[5]});
+    } else if (algorithm == "alsh" && argc >= 8) {
+        L = atoi(argv[3]);
+        K = atoi(argv[4]);
+        sscanf(argv[5], "%f", &r);
+        augtype = atoi(argv[6]);
+        sscanf(argv[7], "%f", &U);
+        build_params.push_back({"L", argv[3]});
+        build_params.push_back({"K", argv[4]});
+        build_params.push_back({"r", argv[5]});
+        build_params.push_back({"augtype", argv[6]});
+        build_params.push_back({"U", argv[7]});
+    } else if (algorithm != "faiss") {
+        printf("Arguments missing, terminating.\n");
+        return 1;
+    }
+
+    // The index footprint is approximated by the growth of the resident set
+    // from before training to after adding, when the loaded data has been
+    // freed.
+    double memory_before = resident_memory_mb();
+    faiss::Index* index = bench_train(get_trained_index);
+    if (algorithm == "quant") {
+        bench_add_chunked(index, 100000);
+    } else {
+        bench_add(index);
+    }
+    rss_growth_mb = resident_memory_mb() - memory_before;
+
+    queries = bench_load_queries();
+    ground_truth = bench_load_ground_truth();
+    assert(ground_truth.vector_count() == queries.vector_count());
+
+    sweep(index);
+    mark_pareto(rows);
+    write_sweep(output, rows);
+    printf("Wrote %zu settings to %s\n", rows.size(), output.c_str());
+    delete index;
+}
@@ -0,0 +1,57 @@
+#include "../src/common.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Compares parse_number with strtod bit for bit, on edge cases and random
+// decimal strings. Exits with 1 on the first mismatch.
+
+static bool check(const std::string& input) {
+    const char* p = input.data();
+    double value;
+    bool parsed = parse_number(p, input.data() + input.size(), value);
+    char* strtod_end;
+    double expected = strtod(input.c_str(), &strtod_end);
+    bool same = parsed && p == strtod_end && memcmp(&value, &expected, sizeof(value)) == 0;
+    if (!same) {
+        printf("Mismatch on \"%s\": parse_number %.17g, strtod %.17g\n",
+                input.c_str(), parsed ? value : 0.0, expected);
+    }
+    return same;
+}
+
+int main() {
+    std::vector<std::string> inputs = {
+        "0", "-0", "1", "-1", "0.1", "1e23", "1e22", "1e-22", "1e-23",
+        "9007199254740992", "9007199254740993", "9007199254740995",
+        "18014398509481985", "123456789012345678901234567890",
+        "0.30000000000000004", "2.2250738585072011e-308", "2.2250738585072014e-308",
+        "1e-310", "4.9e-324", "1e-400", "1.7976931348623157e308", "1e309",
+        "3.14159265358979323846264338327950288", "0.000000000000000000000000123",
+        "1.00000000000000011102230246251565404236316680908203125",
+        "1.5e+5", "-2.5E-3", "7.", ".5", "inf", "-nan",
+    };
+
+    std::mt19937_64 gen(1234);
+    for (size_t i = 0; i < 100000; i++) {
+        std::string digits = std::to_string(gen() >> (gen() % 64));
+        size_t point = gen() % (digits.size() + 1);
+        std::string input = digits.substr(0, point) + "." + digits.substr(point);
+        if (gen() % 2) {
+            input += "e" + std::to_string(int(gen() % 80) - 40);
+        }
+        inputs.push_back(gen() % 2 ? "-" + input : input);
+    }
+
+    for (const auto& input: inputs) {
+        if (!check(input)) {
+            return 1;
+        }
+    }
+    printf("All %zu inputs match strtod\n", inputs.size());
+    return 0;
+}
@@ -1,5 +1,6 @@
 import argparse
 import csv
+import json
 
 import matplotlib.pyplot as plt
 from mpl_toolkits.axes_grid1 import host_subplot
@@ -62,7 +63,45 @@ def create_plot(plot_label, plot_type, fig, host, data, limits):
     host.legend(loc='upper center', bbox_to_anchor=(0.5, -0.15), ncol=2)
     fig.savefig(str(plot_type) + '_plot.pdf')
 
+def read_sweep(filename):
+    """Rows written by bench_sweep, as dicts with params flattened."""
+    if filename.endswith('.json'):
+        with open(filename) as f:
+            rows = json.load(f)
+        for row in rows:
+            row.update(row.pop('params'))
+        return rows
+    with open(filename) as f:
+        return list(csv.DictReader(f))
+
+def draw_pareto(sweeps):
+    fig = plt.figure()
+    host = host_subplot(111)
+    host.set_xscale('log')
+    host.set_xlabel('QPS')
+    host.set_ylabel('Recall@10')
+    plt.suptitle('Recall@10 vs. QPS')
+
+    colors = ['r', 'y', 'b', 'g', 'c', 'm', 'k']
+    for i, filename in enumerate(sweeps):
+        rows = read_sweep(filename)
+        color = colors[i % len(colors)]
+        x = [float(r['qps']) for r in rows]
+        y = [float(r['r10']) for r in rows]
+        host.plot(x, y, color + 'o', markersize=MARKER_SIZE, mfc='none',
+                  markeredgewidth=WIDTH)
+        frontier = sorted((float(r['qps']), float(r['r10'])) for r in rows
+                          if str(r['pareto']) in ('1', 'True'))
+        host.plot([p[0] for p in frontier], [p[1] for p in frontier],
+                  color + '-', linewidth=1, label=filename)
+
+    host.legend(loc='lower left')
+    fig.savefig('pareto_plot.pdf')
+
 def main(args):
+    if args.mode == 'pareto':
+        draw_pareto(args.sweep)
+        return
 
     with open(args.input) as f:
         reader = csv.reader(f, delimiter="\t")
@@ -100,8 +139,10 @@ if __name__ == '__main__':
     parser = argparse.ArgumentParser("A simple utility to create plots with benchmark results.")
     parser.add_argument("--input", default="output.txt",
                         help="File from which the data should be read.")
-    parser.add_argument("--mode", choices={"recall", "inter"}, default="recall",
+    parser.add_argument("--mode", choices={"recall", "inter", "pareto"}, default="recall",
                         help="Controls what plot will be drawn")
+    parser.add_argument("--sweep", nargs="+", default=[],
+                        help="Outputs of bench_sweep for the pareto mode.")
     args = parser.parse_args()
 
     main(args)
@@ -1,14 +1,28 @@
 #include "../src/quantization.h"
+#include "../src/residual.h"
 #include "../src/kmeans.h"
 #include "util.wrap.h"
 
 namespace py = pybind11;
 
 using layer_t = IndexHierarchicKmeans::layer_t;
+using tree_t = IndexHierarchicKmeans::tree_t;
+using leaf_t = IndexHierarchicKmeans::leaf_t;
 
 PYBIND11_MAKE_OPAQUE(std::vector<size_t>);
 PYBIND11_MAKE_OPAQUE(std::vector<std::vector<size_t>>);
-PYBIND11_MAKE_OPAQUE(std::vector<layer_t>);
+
+// Read-only list of references to the elements of a vector member of the
+// tree. Every element keeps the tree alive.
+template <typename T>
+static py::list tree_elements(py::object self, std::vector<T> tree_t::* member) {
+    const tree_t& tree = self.cast<const tree_t&>();
+    py::list result;
+    for (const T& element: tree.*member) {
+        result.append(py::cast(&element, py::return_value_policy::reference_internal, self));
+    }
+    return result;
+}
 
 PYBIND11_MODULE(mips, m) {
     m.doc() = "MIPS library";
@@ -22,7 +36,20 @@ PYBIND11_MODULE(mips, m) {
             py::format_descriptor<float>::format(),
             2,
             { m.vector_count(), m.vector_length },
-            { sizeof(float) * m.vector_count(), sizeof(float) }
+            { sizeof(float) * m.stride, sizeof(float) }
+        );
+    });
+
+    // MATRIX VIEW -----------------------------------------------------------------------------------------------------
+    py::class_<MatrixView<float>> mv(m, "MatrixView", py::buffer_protocol());
+    mv.def_buffer([](MatrixView<float> &m) -> py::buffer_info {
+        return py::buffer_info(
+            (void*) m.data,
+            sizeof(float),
+            py::format_descriptor<float>::format(),
+            2,
+            { m.vector_count(), m.vector_length },
+            { sizeof(float) * m.stride, sizeof(float) }
         );
     });
 
@@ -35,11 +62,41 @@ PYBIND11_MODULE(mips, m) {
                                py::keep_alive<0, 1>());
 
     // LAYER_T ---------------------------------------------------------------------------------------------------------
+    // child_offsets is None for layer 0 of trees with rebuilt layers, tree_t.leaves gives the vectors of leaves.
     py::class_<layer_t>(m, "layer_t")
-        .def_readonly("kr", &layer_t::kr)
-        .def_readonly("centroid_children", &layer_t::centroid_children)
+        .def_property_readonly("child_offsets",
+                               [](layer_t& self) -> py::object {
+                                   if (!self.child_offsets) {
+                                       return py::none();
+                                   }
+                                   return py::array_t<size_t>(self.cluster_num + 1, self.child_offsets,
+                                                              py::capsule(&self, [](void*){}));},
+                               py::keep_alive<0, 1>())
         .def_readonly("cluster_num", &layer_t::cluster_num);
 
+    // LEAF_T ----------------------------------------------------------------------------------------------------------
+    py::class_<leaf_t>(m, "leaf_t")
+        .def_readonly("begin", &leaf_t::begin)
+        .def_readonly("end",   &leaf_t::end)
+        .def_property_readonly("delta_count",
+                               [](const leaf_t& self) { return self.delta ? self.delta->count : 0; });
+
+    // TREE_T ----------------------------------------------------------------------------------------------------------
+    py::class_<tree_t, std::shared_ptr<tree_t>>(m, "tree_t")
+        .def_property_readonly("layers", [](py::object self) { return tree_elements(self, &tree_t::layers); })
+        .def_property_readonly("leaves", [](py::object self) { return tree_elements(self, &tree_t::leaves); })
+        .def_readonly("vectors_original", &tree_t::vectors_original)
+        .def_readonly("appended",         &tree_t::appended)
+        .def_readonly("clamped",          &tree_t::clamped);
+
+    // SEARCH PARAMETERS -----------------------------------------------------------------------------------------------
+    py::class_<SearchParametersHKM>(m, "SearchParametersHKM")
+        .def(py::init<size_t, size_t, float>(),
+             py::arg("opened_trees") = 1, py::arg("candidate_budget") = 0, py::arg("early_stop_margin") = -1)
+        .def_readwrite("opened_trees",      &SearchParametersHKM::opened_trees)
+        .def_readwrite("candidate_budget",  &SearchParametersHKM::candidate_budget)
+        .def_readwrite("early_stop_margin", &SearchParametersHKM::early_stop_margin);
+
     // K-MEANS ---------------------------------------------------------------------------------------------------------
     py::class_<IndexHierarchicKmeans> hkm(m, "IndexHKM");
     hkm.def(
@@ -50,12 +107,36 @@ PYBIND11_MODULE(mips, m) {
     hkm.def_readonly("layers_count", &IndexHierarchicKmeans::layers_count);
     hkm.def_readonly("m",            &IndexHierarchicKmeans::m);
     hkm.def_readonly("opened_trees", &IndexHierarchicKmeans::opened_trees);
-    hkm.def_readonly("vectors",      &IndexHierarchicKmeans::vectors, py::return_value_policy::reference);
-    hkm.def_readonly("layers" ,      &IndexHierarchicKmeans::layers,  py::return_value_policy::reference);
+    // Snapshot of the current tree, None while the index is empty. Published trees are never modified.
+    hkm.def_property_readonly("tree", [](IndexHierarchicKmeans& self) {
+        return std::const_pointer_cast<tree_t>(std::atomic_load(&self.tree)); });
     WRAP_INDEX_HELPER(IndexHierarchicKmeans, hkm);
+    hkm.def("search",
+            [](IndexHierarchicKmeans& self, py::array_t<float, py::array::c_style | py::array::forcecast> data, long k,
+               const SearchParametersHKM& params) {
+                auto n = data.request().shape[0];
+
+                py::array_t<float> distances({n, k});
+                py::array_t<long> labels({n, k});
+
+                auto data_ptr = (float*) data.request().ptr;
+                auto distances_ptr = (float*) distances.request().ptr;
+                auto labels_ptr = (long*) labels.request().ptr;
+
+                self.search(n, data_ptr, k, distances_ptr, labels_ptr, params);
+
+                return std::make_tuple(distances, labels);
+            },
+            "data"_a, "k"_a, "params"_a,
+            "Search data vectors for k closest vectors with per-call search parameters");
+    m.def("write_index_hkm", &write_index_hkm, "index"_a, "filename"_a);
+    m.def("read_index_hkm", &read_index_hkm, "filename"_a, py::return_value_policy::take_ownership);
 
     // QUANTIZATION ----------------------------------------------------------------------------------------------------
     py::class_<IndexSubspaceQuantization> sq(m, "IndexSQ");
     WRAP_INDEX_HELPER(IndexSubspaceQuantization, sq);
 
+    py::class_<IndexResidualQuantization> rq(m, "IndexRQ");
+    WRAP_INDEX_HELPER(IndexResidualQuantization, rq);
+
 }